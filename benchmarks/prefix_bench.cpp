@@ -0,0 +1,97 @@
+#include "dense_graph.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace dstates::ai;
+using namespace std::chrono;
+
+/**
+ * compares the per-parent cost of get_lcp and dense_lcp on a population of models that mutate a common
+ * base graph, the way a search derives new candidates from the models it already stored
+ *
+ * usage: prefix_bench [catalog size] [parents] [vertices per graph] [rounds]
+ */
+
+static digraph_t mutate(const std::vector<vertex_t> &base, size_t keep, vertex_t &next, std::mt19937_64 &rng,
+			model_id_t id) {
+    // the first keep vertices of the base chain are shared, the rest of the graph is new
+    digraph_t g;
+    g.id = id;
+    g.root = base[0];
+    std::vector<vertex_t> vertices(base.begin(), base.begin() + keep);
+    for (size_t i = keep; i < base.size(); i++)
+	vertices.push_back(next++);
+    for (size_t i = 1; i < vertices.size(); i++) {
+	// a skip connection every few layers, as in residual networks
+	std::vector<vertex_t> sources{vertices[i - 1]};
+	if (i >= 3 && rng() % 4 == 0)
+	    sources.push_back(vertices[i - 3]);
+	for (auto &u : sources)
+	    if (g.out_edges[u].insert(vertices[i]).second)
+		g.in_degree[vertices[i]]++;
+    }
+    return g;
+}
+
+int main(int argc, char **argv) {
+    size_t capacity = argc > 1 ? std::atol(argv[1]) : 1 << 16;
+    size_t parents = argc > 2 ? std::atol(argv[2]) : 1000;
+    size_t vertices = argc > 3 ? std::atol(argv[3]) : 64;
+    size_t rounds = argc > 4 ? std::atol(argv[4]) : 10;
+    std::mt19937_64 rng(1729);
+    std::vector<vertex_t> base(vertices);
+    for (size_t i = 0; i < vertices; i++)
+	base[i] = i;
+    vertex_t next = vertices;
+
+    dense_catalog_t catalog(capacity);
+    std::vector<digraph_t> population;
+    std::vector<dense_graph_t> dense;
+    for (size_t i = 0; i < parents; i++) {
+	auto g = mutate(base, 1 + rng() % vertices, next, rng, i);
+	dense_graph_t d;
+	if (!make_dense(g, catalog, true, d)) {
+	    std::cerr << "catalog of " << capacity << " vertices is full after " << i << " parents" << std::endl;
+	    return 1;
+	}
+	population.emplace_back(std::move(g));
+	dense.emplace_back(std::move(d));
+    }
+    auto child = mutate(base, vertices / 2 + rng() % (vertices / 2 + 1), next, rng, parents);
+    dense_graph_t child_dense;
+    make_dense(child, catalog, false, child_dense);
+
+    // both kernels must find the same vertices, the order of siblings may differ
+    dense_scratch_t scratch;
+    for (size_t i = 0; i < parents; i++) {
+	auto a = get_lcp(child, population[i]), b = dense_lcp(child_dense, dense[i], catalog, scratch);
+	std::sort(a.begin(), a.end());
+	std::sort(b.begin(), b.end());
+	if (a != b) {
+	    std::cerr << "prefixes differ for parent " << i << std::endl;
+	    return 1;
+	}
+    }
+
+    size_t checksum = 0;
+    auto start = steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+	for (auto &parent : population)
+	    checksum += get_lcp(child, parent).size();
+    double sparse = duration_cast<nanoseconds>(steady_clock::now() - start).count() / (double)(rounds * parents);
+    start = steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+	for (auto &parent : dense)
+	    checksum -= dense_lcp(child_dense, parent, catalog, scratch).size();
+    double bitset = duration_cast<nanoseconds>(steady_clock::now() - start).count() / (double)(rounds * parents);
+
+    std::cout << "catalog " << capacity << ", " << parents << " parents of " << vertices << " vertices" << std::endl;
+    std::cout << "get_lcp:   " << sparse << " ns per parent" << std::endl;
+    std::cout << "dense_lcp: " << bitset << " ns per parent" << std::endl;
+    std::cout << "speedup:   " << sparse / bitset << "x" << std::endl;
+    return checksum == 0 ? 0 : 1;
+}
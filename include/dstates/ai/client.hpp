@@ -11,12 +11,16 @@ namespace tl = thallium;
 * C++ client for Dstates-AI, it performs RPC calls and RMDA to communicate with the server
 */
 class rpc_client {
-    tl::remote_procedure _store_meta, _get_prefix, _get_composition, _store_layers, _read_layers, _update_ref_counter, _shutdown;
+    tl::remote_procedure _store_meta, _get_prefixes, _get_composition, _store_layers, _read_layers, _update_ref_counter,
+	_commit_model, _get_ancestors, _get_descendants, _retire_subtree, _get_meta, _import_models, _abort_import,
+	_shutdown;
     std::vector<tl::provider_handle> providers;
     std::unordered_map<model_id_t, composition_t> comp_cache;
     tl::mutex cache_lock;
     tl::engine engine;
 
+    model_id_list_t lineage_closure(tl::remote_procedure &rpc, const model_id_t &id);
+
 public:
     /**
      * we load balance across providers
@@ -42,6 +46,10 @@ public:
      * get the model that has the most closely matching prefix for the model, breaking ties on accuracy
      */
     prefix_t get_prefix(const digraph_t &child);
+    /**
+     * get the best k parents across all providers that satisfy the filters of the query, best first
+     */
+    prefix_match_list_t get_prefixes(const digraph_t &child, const prefix_query_t &query);
     /**
      * get the composition of a model in terms of layers
      */
@@ -52,32 +60,110 @@ public:
      * \param[in] id model id to store
      * \param[in] layer_id ids of all of the layers to store
      * \param[in] segments memory for all of the segments to send
+     * \param[in] encodings layer_encoding_t of each segment, empty if all of them are raw
      * \param[in,out] timestamps appends timestamps produced by storing the layers
      *
      * TODO segments is only marked as non-const here because of thalliums API; we can get around this with a const_cast
      *
      */
     bool store_layers(const model_id_t &id, const vertex_list_t &layer_id,
-		      const std::vector<segment_t> &segments);
+		      const std::vector<segment_t> &segments,
+		      const std::vector<uint8_t> &encodings = std::vector<uint8_t>());
     /**
      * read the layers from the server
      *
      * \param[in] id model id to store
      * \param[in] layer_id ids of all of the layers to store
-     * \param[out] segment_list where to write all of the segments from the model
+     * \param[out] segment_list where to write all of the segments from the model, encoded layers
+     *             are decoded in place so each segment must hold the full fp32 layer
+     * \param[in] fp32 for each segment, whether it is an fp32 buffer that encoded layers may be decoded
+     *            into, empty if all of them are; an encoded layer read into any other segment, or into a
+     *            segment that is not exactly the size of the decoded layer, fails the read
      * \param[in,out] timestamps appends timestamps produced by storing the layers
      *
      * TODO segments is only marked as non-const here because of thalliums API; we can get around this with a const_cast
      *
      */
     bool read_layers(const model_id_t &id, const vertex_list_t &layer_id,
-		     std::vector<segment_t> &segment_list, std::vector<uint64_t> &owners);
+		     std::vector<segment_t> &segment_list, std::vector<uint64_t> &owners,
+		     const std::vector<bool> &fp32 = {});
+    /**
+     * pending read issued by read_layers_async, the bulk handles are kept alive until wait() returns
+     */
+    struct read_handle_t {
+	std::vector<tl::bulk> bulks;
+	std::vector<tl::async_response> reps;
+	std::vector<std::vector<segment_t>> segments;
+	/// position in segment_list of each segment, grouped like segments
+	std::vector<std::vector<size_t>> index;
+	std::vector<bool> fp32;
+	/// filled by wait(), true for the segments of segment_list that received a decoded layer
+	std::vector<bool> decoded;
+	/**
+	 * block until all owners answered and decode the encoded layers, returns true only if all layers were read
+	 */
+	bool wait();
+    };
+    /**
+     * same as read_layers, but returns immediately; segment_list must stay valid until wait()
+     */
+    read_handle_t read_layers_async(const model_id_t &id, const vertex_list_t &layer_id,
+				    std::vector<segment_t> &segment_list, std::vector<uint64_t> &owners,
+				    const std::vector<bool> &fp32 = {});
 
     /**
      * change the ref counter for id via +=value
      */
     bool update_ref_counter(const model_id_t &id, int value);
 
+    /**
+     * store the new layers, the metadata and increment the ref counters of all layers in the
+     * composition in a single round trip (plus one per remote provider hosting inherited layers)
+     *
+     * \param[in] g the graph describing the model to store
+     * \param[in] comp the composition of the model in terms of layers
+     * \param[in] layer_id ids of the new layers, owned by g.id
+     * \param[in] segments memory for all of the new layers to send
+     * \param[in] encodings layer_encoding_t of each segment, empty if all of them are raw
+     */
+    bool commit_model(const digraph_t &g, const composition_t &comp, float val_acc,
+		      const vertex_list_t &layer_id, const std::vector<segment_t> &segments,
+		      const std::vector<uint8_t> &encodings = std::vector<uint8_t>());
+
+    /**
+     * get all the models whose layers id inherits, directly or transitively
+     */
+    model_id_list_t get_ancestors(const model_id_t &id);
+    /**
+     * get all the models that inherit layers from id, directly or transitively
+     */
+    model_id_list_t get_descendants(const model_id_t &id);
+    /**
+     * retire id and all of its descendants, releasing the layers of their compositions in one pass
+     *
+     * \return the ids of the retired models
+     */
+    model_id_list_t retire_subtree(const model_id_t &id);
+
+    /**
+     * write the models and all the layers of their compositions to a single file, see model_file.hpp
+     *
+     * \param[in] ids models to export, the layers they share are written once
+     * \param[in] path file to create or overwrite
+     */
+    bool export_models(const model_id_list_t &ids, const std::string &path);
+    /**
+     * load a file written by export_models into the servers; models that already exist are left as they
+     * are, layers that already exist are shared with the imported models. The import is all or nothing:
+     * if a server cannot take its share, those that did are rolled back
+     *
+     * \param[in] path file to import, read by the client for the list of models and by the servers for
+     *            everything else, so it must be accessible to all of them
+     * \param[out] imported the ids of the imported models
+     * \return false if the file cannot be read or a server could not take its share, nothing is imported then
+     */
+    bool import_models(const std::string &path, model_id_list_t &imported);
+
     /**
      * indicate that shutdown will occur and give thallium time to cleanup
      */
@@ -2,6 +2,7 @@
 #define __DSTATES_AI_TYPES_HPP
 
 #include <cstdint>
+#include <limits>
 #include <string>
 #include <vector>
 #include <unordered_set>
@@ -44,10 +45,96 @@ typedef std::vector<model_id_t> model_id_list_t;
  * TODO should this be a model -> (vertex, size)
  */
 typedef std::unordered_map<vertex_t, std::pair<model_id_t, size_t>> composition_t;
+/**
+ * how a layer is stored, the reduced precision encodings apply to fp32 layers only
+ */
+enum layer_encoding_t : uint8_t {
+    ENCODING_RAW = 0,
+    /// bfloat16, keeps the fp32 range
+    ENCODING_BF16,
+    /// IEEE half precision
+    ENCODING_FP16,
+    /// int8 with one fp32 scale per output channel
+    ENCODING_INT8
+};
+/**
+ * stored form of the layers sent back by read_layers, in request order
+ */
+struct read_reply_t {
+    bool ok = false;
+    std::vector<uint8_t> encodings;
+    std::vector<size_t> sizes;
+
+    template<typename A> void serialize(A& ar) {
+        ar & ok;
+        ar & encodings;
+        ar & sizes;
+    }
+};
+/**
+ * maps an owner to the layers whose ref counter needs to change
+ */
+typedef std::unordered_map<model_id_t, vertex_list_t> ref_update_t;
 /**
  * maps a model_id to list of verticies in the generalized longest common prefix
  */
 typedef std::pair<model_id_t, vertex_list_t> prefix_t;
+/**
+ * filters of a prefix query, the defaults match the single best prefix
+ */
+struct prefix_query_t {
+    /// how many matches to return at most
+    size_t k = 1;
+    /// skip parents whose accuracy is below this threshold
+    float min_accuracy = std::numeric_limits<float>::lowest();
+    /// skip matches whose prefix is shorter than this
+    size_t min_prefix_len = 0;
+    /// skip these parents
+    std::unordered_set<model_id_t> exclude;
+
+    template<typename A> void serialize(A& ar) {
+        ar & k;
+        ar & min_accuracy;
+        ar & min_prefix_len;
+        ar & exclude;
+    }
+};
+/**
+ * a parent matching a prefix query
+ */
+struct prefix_match_t {
+    model_id_t id = 0;
+    vertex_list_t prefix;
+    float val_acc = 0;
+
+    /// longer prefixes are better, ties are broken on accuracy
+    bool better_than(const prefix_match_t &other) const {
+        return prefix.size() > other.prefix.size() ||
+            (prefix.size() == other.prefix.size() && val_acc > other.val_acc);
+    }
+    template<typename A> void serialize(A& ar) {
+        ar & id;
+        ar & prefix;
+        ar & val_acc;
+    }
+};
+/**
+ * matches of a prefix query, best first
+ */
+typedef std::vector<prefix_match_t> prefix_match_list_t;
+/**
+ * insert m into a best-first list that holds at most k matches, equal matches keep their arrival order
+ */
+inline void insert_match(prefix_match_list_t &list, prefix_match_t &&m, size_t k) {
+    auto it = list.begin();
+    while (it != list.end() && !m.better_than(*it))
+        ++it;
+    if ((size_t)(it - list.begin()) >= k)
+        return;
+    list.insert(it, std::move(m));
+    if (list.size() > k)
+        list.pop_back();
+}
 /**
  *
  * TODO this needs a better name in the context of the program
@@ -72,6 +159,22 @@ struct digraph_t {
         ar & in_degree;
     }
 };
+/**
+ * everything the server knows about a model besides its layers, ok is false for unknown models
+ */
+struct model_meta_t {
+    bool ok = false;
+    digraph_t graph;
+    composition_t composition;
+    float val_acc = 0;
+
+    template<typename A> void serialize(A& ar) {
+        ar & ok;
+        ar & graph;
+        ar & composition;
+        ar & val_acc;
+    }
+};
 }
 
 #endif
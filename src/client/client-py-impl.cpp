@@ -1,13 +1,18 @@
 #include "client-py-impl.hpp"
 #include "dstates/ai/client.hpp"
+#include "precision.hpp"
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <cuda_runtime.h>
+#include <fcntl.h>
 #include <map>
 #include <nanobind/nanobind.h>
 #include <numeric>
 #include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
 #include <vector>
 
 #define __DEBUG
@@ -16,67 +21,231 @@
 namespace dstates::ai {
 namespace nb = nanobind;
 
-py_backend::py_backend(const std::string &thallium_cfg, const std::vector<std::string> &servers, size_t buffer_size) {
+static bool make_graph(uint64_t id, const uint64_list_t &edges, digraph_t &g) {
+    if (edges.size() < 2 || edges.size() % 2 != 0)
+	return false;
+    g.root = edges[0];
+    g.id = id;
+    for (int i = 0; i < edges.size(); i += 2) {
+	g.out_edges[edges[i]].insert(edges[i + 1]);
+	g.in_degree[edges[i + 1]]++;
+    }
+    return true;
+}
+
+static size_t tensor_bytes(const nb::ndarray<> &t) {
+    return t.size() * t.dtype().bits / 8;
+}
+
+py_backend::py_backend(const std::string &thallium_cfg, const std::vector<std::string> &servers, size_t buffer_size,
+		       size_t cache_size, bool prefetch, const buffer_options_t &buffer_opts)
+    : cache_capacity(cache_size), prefetch_enabled(prefetch) {
     std::vector<int> providers(servers.size());
     std::iota(providers.begin(), providers.end(), 0);
-    mem_buffer = std::make_unique<char[]>(buffer_size);
-    buffer_resource =
-	std::make_unique<std::pmr::monotonic_buffer_resource>(mem_buffer.get(), buffer_size,
-							      std::pmr::null_memory_resource());
-    pool = std::make_unique<std::pmr::unsynchronized_pool_resource>(buffer_resource.get());
+    mem_buffer = std::make_unique<pinned_buffer_t>(buffer_size, buffer_opts);
+    pool = std::make_unique<region_resource_t>(mem_buffer->data(), buffer_size);
     client = std::make_unique<rpc_client>(thallium_cfg, servers, providers);
 }
 
-bool py_backend::save_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids) {
-    std::pmr::vector<char> temp{pool.get()};
-    std::pmr::vector<char> ptrs[tensors.size()];
-    for (int i = 0; i < tensors.size(); ++i)
-	ptrs[i] = temp;
+py_backend::~py_backend() {
+    // the server may still be writing into the cache, wait before the bulk and the buffer go away
+    complete_prefetch();
+}
+
+bool py_backend::cache_reserve(size_t size) {
+    if (size > cache_capacity)
+	return false;
+    while (cache_used + size > cache_capacity)
+	cache_erase(lru_order.back());
+    return true;
+}
+
+py_backend::cached_layer_t *py_backend::cache_insert(const layer_key_t &key, size_t size) {
+    cache_erase(key);
+    if (!cache_reserve(size))
+	return nullptr;
+    std::pmr::vector<char> data{pool.get()};
+    try {
+	data.resize(size);
+    } catch (std::bad_alloc &e) {
+	DBG("cannot cache layer " << key.vertex << " of owner " << key.owner << ", staging buffer is full");
+	return nullptr;
+    }
+    lru_order.push_front(key);
+    cache_used += size;
+    auto it = layer_cache.emplace(key, cached_layer_t{std::move(data), lru_order.begin()}).first;
+    return &it->second;
+}
+
+void py_backend::cache_erase(const layer_key_t &key) {
+    auto it = layer_cache.find(key);
+    if (it == layer_cache.end())
+	return;
+    cache_used -= it->second.data.size();
+    lru_order.erase(it->second.lru);
+    layer_cache.erase(it);
+}
+
+void py_backend::complete_prefetch() {
+    if (!pending)
+	return;
+    if (!pending->handle.wait())
+	for (auto &key : pending->keys)
+	    cache_erase(key);
+    else
+	for (int i = 0; i < pending->keys.size(); i++)
+	    layer_cache.at(pending->keys[i]).decoded = pending->handle.decoded[i];
+    pending.reset();
+}
 
+void py_backend::prefetch_prefix(const prefix_t &prefix) {
+    if (prefix.second.empty())
+	return;
+    auto &comp = client->get_composition(prefix.first);
+    std::vector<layer_key_t> keys;
+    std::vector<size_t> sizes;
+    size_t total = 0;
+    for (auto &v : prefix.second) {
+	auto it = comp.find(v);
+	if (it == comp.end())
+	    continue;
+	layer_key_t key{v, it->second.first};
+	auto c_it = layer_cache.find(key);
+	if (c_it != layer_cache.end()) {
+	    lru_order.splice(lru_order.begin(), lru_order, c_it->second.lru);
+	    continue;
+	}
+	if (total + it->second.second > cache_capacity)
+	    break;
+	total += it->second.second;
+	keys.emplace_back(key);
+	sizes.emplace_back(it->second.second);
+    }
+    // make room for the whole batch upfront, so that inserting it does not evict its own layers
+    if (keys.empty() || !cache_reserve(total))
+	return;
+    vertex_list_t layer_ids;
+    uint64_list_t owners;
     std::vector<segment_t> segments;
-    if (tensors[0].device_type() == nb::device::cpu::value) {
-	for (auto &t : tensors)
-	    segments.emplace_back((void *)t.data(), (size_t)(t.size() * sizeof(t.dtype())));
-    } else {
-	int iter = 0;
-	for (auto &t : tensors) {
-	    auto size = (size_t)(t.size() * sizeof(t.dtype()));
-	    ptrs[iter].resize(size);
-	    cudaMemcpy((char *)ptrs[iter].data(), (char *)t.data(), size, cudaMemcpyDeviceToHost);
-	    segments.emplace_back((void *)ptrs[iter].data(), size);
-	    iter++;
+    for (int i = 0; i < keys.size(); i++) {
+	auto entry = cache_insert(keys[i], sizes[i]);
+	if (entry == nullptr)
+	    break;
+	layer_ids.emplace_back(keys[i].vertex);
+	owners.emplace_back(keys[i].owner);
+	segments.emplace_back((void *)entry->data.data(), sizes[i]);
+    }
+    keys.resize(segments.size());
+    if (keys.empty())
+	return;
+    DBG("prefetching " << keys.size() << " layers of model " << prefix.first);
+    pending.emplace(prefetch_t{client->read_layers_async(prefix.first, layer_ids, segments, owners), std::move(keys)});
+}
+
+void py_backend::stage_tensors(tensor_list_t &tensors, const uint64_list_t &encodings,
+			       std::vector<std::pmr::vector<char>> &staging, std::vector<segment_t> &segments,
+			       std::vector<uint8_t> &stored) {
+    staging.reserve(2 * tensors.size());
+    for (int i = 0; i < tensors.size(); i++) {
+	auto &t = tensors[i];
+	char *data = (char *)t.data();
+	size_t size = tensor_bytes(t);
+	if (t.device_type() != nb::device::cpu::value) {
+	    auto &buf = staging.emplace_back(pool.get());
+	    buf.resize(size);
+	    cudaMemcpy(buf.data(), data, size, cudaMemcpyDeviceToHost);
+	    data = buf.data();
+	}
+	// reduced precision applies to fp32 tensors whose channels split evenly, anything else is sent raw
+	auto encoding = i < encodings.size() ? (layer_encoding_t)encodings[i] : ENCODING_RAW;
+	size_t n = t.size(), channels = t.ndim() >= 2 ? t.shape(0) : 1;
+	size_t encoded = t.dtype() == nb::dtype<float>() && channels > 0 && n % channels == 0
+	    ? encoded_size(encoding, n, channels) : 0;
+	if (encoded == 0) {
+	    segments.emplace_back((void *)data, size);
+	    stored.emplace_back(ENCODING_RAW);
+	    continue;
 	}
+	// the encoded copy is sent from ordinary heap memory, like the CPU tensors themselves, so that
+	// it never competes with the layer cache for the pinned buffer
+	auto &buf = staging.emplace_back(std::pmr::new_delete_resource());
+	buf.resize(encoded);
+	encode_layer(encoding, (const float *)data, n, channels, buf.data());
+	segments.emplace_back((void *)buf.data(), encoded);
+	stored.emplace_back(encoding);
     }
-    return client->store_layers(model_id, layer_ids, segments);
+}
+
+bool py_backend::save_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids,
+                             uint64_list_t &encodings) {
+    complete_prefetch();
+    for (auto &v : layer_ids)
+	cache_erase({v, model_id});
+    std::vector<std::pmr::vector<char>> staging;
+    std::vector<segment_t> segments;
+    std::vector<uint8_t> stored;
+    stage_tensors(tensors, encodings, staging, segments, stored);
+    return client->store_layers(model_id, layer_ids, segments, stored);
 }
 
 bool py_backend::load_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids,
                             uint64_list_t &layer_owners) {
+    complete_prefetch();
+    bool is_gpu = (tensors[0].device_type() != nb::device::cpu::value);
+    // serve what we can from the cache, only the misses are read from the servers
+    std::vector<int> misses;
+    for (int i = 0; i < tensors.size(); i++) {
+	auto &t = tensors[i];
+	auto size = tensor_bytes(t);
+	auto it = layer_cache.find({layer_ids[i], layer_owners[i]});
+	if (it == layer_cache.end() || it->second.data.size() != size ||
+	    (it->second.decoded && t.dtype() != nb::dtype<float>())) {
+	    misses.emplace_back(i);
+	    continue;
+	}
+	lru_order.splice(lru_order.begin(), lru_order, it->second.lru);
+	if (is_gpu)
+	    cudaMemcpy((char *)t.data(), it->second.data.data(), size, cudaMemcpyHostToDevice);
+	else
+	    std::memcpy((char *)t.data(), it->second.data.data(), size);
+    }
+    if (misses.empty())
+	return true;
+
     std::pmr::vector<char> temp{pool.get()};
-    std::pmr::vector<char> ptrs[tensors.size()];
+    std::pmr::vector<char> ptrs[misses.size()];
     std::vector<segment_t> segments;
-    for (int i = 0; i < tensors.size(); ++i)
+    vertex_list_t miss_ids;
+    uint64_list_t miss_owners;
+    // encoded layers are decoded to fp32, tensors of any other dtype cannot take them
+    std::vector<bool> fp32;
+    for (int i = 0; i < misses.size(); ++i)
 	ptrs[i] = temp;
-    bool is_gpu = (tensors[0].device_type() != nb::device::cpu::value);
-    if (!is_gpu) {
-	for (auto &t : tensors)
-	    segments.emplace_back((void *)t.data(), (size_t)(t.size() * sizeof(t.dtype())));
-    } else {
-	int iter = 0;
-	for (auto &t : tensors) {
-	    auto size = (size_t)(t.size() * sizeof(t.dtype()));
-	    ptrs[iter].resize(size);
-	    segments.emplace_back((void *)ptrs[iter].data(), size);
-	    iter++;
+    for (int i = 0; i < misses.size(); ++i) {
+	auto &t = tensors[misses[i]];
+	auto size = tensor_bytes(t);
+	miss_ids.emplace_back(layer_ids[misses[i]]);
+	miss_owners.emplace_back(layer_owners[misses[i]]);
+	fp32.emplace_back(t.dtype() == nb::dtype<float>());
+	if (!is_gpu)
+	    segments.emplace_back((void *)t.data(), size);
+	else {
+	    ptrs[i].resize(size);
+	    segments.emplace_back((void *)ptrs[i].data(), size);
 	}
     }
-    bool ret = client->read_layers(model_id, layer_ids, segments, layer_owners);
-    if (is_gpu) {
-	int iter = 0;
-	for (auto &t : tensors) {
-	    cudaMemcpy((char *)t.data(), (char *)segments[iter].first, segments[iter].second, cudaMemcpyHostToDevice);
-	    ++iter;
-	}
+    auto handle = client->read_layers_async(model_id, miss_ids, segments, miss_owners, fp32);
+    bool ret = handle.wait();
+    for (int i = 0; i < misses.size(); ++i) {
+	if (is_gpu)
+	    cudaMemcpy((char *)tensors[misses[i]].data(), (char *)segments[i].first, segments[i].second, cudaMemcpyHostToDevice);
+	if (!ret || cache_capacity == 0)
+	    continue;
+	auto entry = cache_insert({miss_ids[i], miss_owners[i]}, segments[i].second);
+	if (entry == nullptr)
+	    continue;
+	std::memcpy(entry->data.data(), segments[i].first, segments[i].second);
+	entry->decoded = handle.decoded[i];
     }
     return ret;
 }
@@ -84,16 +253,10 @@ bool py_backend::load_layers(tensor_list_t &tensors, uint64_t model_id, uint64_l
 bool py_backend::store_meta(uint64_t id, uint64_list_t &edges, uint64_list_t &layer_ids,
                             uint64_list_t &layer_owners, uint64_list_t &sizes,
                             const float val_acc) {
-    if (edges.size() < 2 || edges.size() % 2 != 0 ||
+    digraph_t g;
+    if (!make_graph(id, edges, g) ||
 	layer_ids.size() != layer_owners.size() || layer_ids.size() != sizes.size())
 	return false;
-    digraph_t g;
-    g.root = edges[0];
-    g.id = id;
-    for (int i = 0; i < edges.size(); i += 2) {
-	g.out_edges[edges[i]].insert(edges[i + 1]);
-	g.in_degree[edges[i + 1]]++;
-    }
     composition_t comp;
     for (int i = 0; i < layer_ids.size(); i++)
 	comp.emplace(layer_ids[i], std::make_pair(layer_owners[i], sizes[i]));
@@ -101,27 +264,182 @@ bool py_backend::store_meta(uint64_t id, uint64_list_t &edges, uint64_list_t &la
     return client->store_meta(g, comp, val_acc);
 }
 
+bool py_backend::commit_model(tensor_list_t &tensors, uint64_t id, uint64_list_t &edges,
+                              uint64_list_t &layer_ids, uint64_list_t &layer_owners,
+                              uint64_list_t &sizes, const float val_acc, uint64_list_t &encodings) {
+    digraph_t g;
+    if (!make_graph(id, edges, g) ||
+	layer_ids.size() != layer_owners.size() || layer_ids.size() != sizes.size())
+	return false;
+    complete_prefetch();
+    // the tensors hold the new layers, i.e. those owned by the model itself, in composition order
+    composition_t comp;
+    vertex_list_t new_ids;
+    for (int i = 0; i < layer_ids.size(); i++) {
+	comp.emplace(layer_ids[i], std::make_pair(layer_owners[i], sizes[i]));
+	if (layer_owners[i] == id) {
+	    new_ids.emplace_back(layer_ids[i]);
+	    cache_erase({layer_ids[i], id});
+	}
+    }
+    if (new_ids.size() != tensors.size())
+	return false;
+
+    std::vector<std::pmr::vector<char>> staging;
+    std::vector<segment_t> segments;
+    std::vector<uint8_t> stored;
+    stage_tensors(tensors, encodings, staging, segments, stored);
+    return client->commit_model(g, comp, val_acc, new_ids, segments, stored);
+}
+
 composition_t py_backend::get_composition(uint64_t model_id) {
     return client->get_composition(model_id);
 }
 
 prefix_t py_backend::get_prefix(uint64_list_t &edges) {
-    if (edges.size() < 2 || edges.size() % 2 != 0)
+    digraph_t g;
+    if (!make_graph(0, edges, g))
 	return prefix_t();
+    complete_prefetch();
+    prefix_t prefix = client->get_prefix(g);
+    if (prefetch_enabled && cache_capacity > 0)
+	prefetch_prefix(prefix);
+    return prefix;
+}
+
+prefix_match_list_t py_backend::get_prefixes(uint64_list_t &edges, size_t k, float min_accuracy,
+                                             size_t min_prefix_len, uint64_list_t &exclude) {
     digraph_t g;
-    g.root = edges[0];
-    for (int i = 0; i < edges.size(); i += 2) {
-	g.out_edges[edges[i]].insert(edges[i + 1]);
-	g.in_degree[edges[i + 1]]++;
-    }
-    return client->get_prefix(g);
+    if (!make_graph(0, edges, g))
+	return prefix_match_list_t();
+    prefix_query_t query;
+    query.k = k;
+    query.min_accuracy = min_accuracy;
+    query.min_prefix_len = min_prefix_len;
+    query.exclude.insert(exclude.begin(), exclude.end());
+    complete_prefetch();
+    return client->get_prefixes(g, query);
 }
 
 bool py_backend::update_ref_counter(uint64_t id, int value) {
+    complete_prefetch();
+    if (value < 0)
+	for (auto it = layer_cache.begin(); it != layer_cache.end();) {
+	    auto key = (it++)->first;
+	    if (key.owner == id)
+		cache_erase(key);
+	}
     return client->update_ref_counter(id, value);
 }
 
+uint64_list_t py_backend::get_ancestors(uint64_t id) {
+    return client->get_ancestors(id);
+}
+
+uint64_list_t py_backend::get_descendants(uint64_t id) {
+    return client->get_descendants(id);
+}
+
+uint64_list_t py_backend::retire_subtree(uint64_t id) {
+    complete_prefetch();
+    auto retired = client->retire_subtree(id);
+    std::unordered_set<model_id_t> owners(retired.begin(), retired.end());
+    for (auto it = layer_cache.begin(); it != layer_cache.end();) {
+	auto key = (it++)->first;
+	if (owners.contains(key.owner))
+	    cache_erase(key);
+    }
+    return retired;
+}
+
+bool py_backend::export_models(uint64_list_t &ids, const std::string &path) {
+    complete_prefetch();
+    return client->export_models(ids, path);
+}
+
+std::optional<uint64_list_t> py_backend::import_models(const std::string &path) {
+    // None tells a failed import apart from a file with nothing new in it
+    uint64_list_t imported;
+    if (!client->import_models(path, imported))
+	return std::nullopt;
+    return imported;
+}
+
 int py_backend::shutdown() {
+    complete_prefetch();
     return client->shutdown();
 }
+
+py_model_file::py_model_file(const std::string &path) {
+    model_file_header_t header;
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !meta.read(fd, header)) {
+	if (fd >= 0)
+	    close(fd);
+	throw std::runtime_error("cannot open model file " + path);
+    }
+    // private mapping: the views are writable, but writes never reach the file
+    length = st.st_size;
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+	throw std::runtime_error("cannot map model file " + path + ": " + std::strerror(errno));
+    ptr = (char *)addr;
+    for (size_t i = 0; i < meta.models.size(); i++)
+	model_index.emplace(meta.models[i].graph.id, i);
+    for (size_t i = 0; i < meta.layers.size(); i++)
+	layer_index.emplace(std::make_pair(meta.layers[i].vertex, meta.layers[i].owner), i);
+}
+
+py_model_file::~py_model_file() {
+    munmap(ptr, length);
+}
+
+const model_meta_t &py_model_file::find_model(uint64_t id) const {
+    auto it = model_index.find(id);
+    if (it == model_index.end())
+	throw std::out_of_range("model " + std::to_string(id) + " is not in the file");
+    return meta.models[it->second];
+}
+
+uint64_list_t py_model_file::models() const {
+    uint64_list_t ids;
+    for (auto &m : meta.models)
+	ids.emplace_back(m.graph.id);
+    return ids;
+}
+
+uint64_list_t py_model_file::get_edges(uint64_t id) const {
+    // same format as store_meta, which takes the root from the first edge
+    auto &g = find_model(id).graph;
+    uint64_list_t edges;
+    auto root = g.out_edges.find(g.root);
+    if (root != g.out_edges.end())
+	for (auto &v : root->second)
+	    edges.insert(edges.end(), {g.root, v});
+    for (auto &[u, out] : g.out_edges)
+	if (u != g.root)
+	    for (auto &v : out)
+		edges.insert(edges.end(), {u, v});
+    return edges;
+}
+
+composition_t py_model_file::get_composition(uint64_t id) const {
+    return find_model(id).composition;
+}
+
+float py_model_file::get_val_acc(uint64_t id) const {
+    return find_model(id).val_acc;
+}
+
+nb::ndarray<nb::numpy, uint8_t, nb::ndim<1>> py_model_file::get_layer(uint64_t vertex, uint64_t owner) {
+    auto it = layer_index.find({vertex, owner});
+    if (it == layer_index.end())
+	throw std::out_of_range("layer " + std::to_string(vertex) + " of owner " + std::to_string(owner) +
+				" is not in the file");
+    auto &layer = meta.layers[it->second];
+    size_t shape[1] = {layer.size};
+    return nb::ndarray<nb::numpy, uint8_t, nb::ndim<1>>(ptr + layer.offset, 1, shape, nb::handle());
+}
 } // namespace dstates::ai
@@ -2,10 +2,16 @@
 #define __DSTATES_AI_PYCLIENT_HPP
 
 #include "dstates/ai/client.hpp"
+#include "model_file.hpp"
+#include "pinned_memory.hpp"
+#include "region_resource.hpp"
 
 #include <cstdlib>
+#include <list>
+#include <map>
 #include <memory>
 #include <memory_resource>
+#include <optional>
 #include <string>
 #include <nanobind/ndarray.h>
 
@@ -15,24 +21,106 @@ using string_list_t = std::vector<std::string>;
 
 namespace dstates::ai {
 class py_backend {
-    std::unique_ptr<char[]> mem_buffer;
-    std::unique_ptr<std::pmr::memory_resource> buffer_resource, pool;
+    /**
+     * layers are immutable once stored, so (vertex, owner) identifies the content of a cached layer
+     */
+    struct layer_key_t {
+	vertex_t vertex;
+	model_id_t owner;
+	bool operator==(const layer_key_t &other) const {
+	    return vertex == other.vertex && owner == other.owner;
+	}
+    };
+    struct layer_key_hash_t {
+	size_t operator()(const layer_key_t &key) const {
+	    return std::hash<vertex_t>()(key.vertex) ^ (std::hash<model_id_t>()(key.owner) << 1);
+	}
+    };
+    struct cached_layer_t {
+	std::pmr::vector<char> data;
+	std::list<layer_key_t>::iterator lru;
+	/// data holds the fp32 values of an encoded layer, only fp32 tensors can take it
+	bool decoded = false;
+    };
+    /**
+     * prefetch started by get_prefix, its layers are already in layer_cache but not yet valid
+     */
+    struct prefetch_t {
+	rpc_client::read_handle_t handle;
+	std::vector<layer_key_t> keys;
+    };
+
+    std::unique_ptr<pinned_buffer_t> mem_buffer;
+    /// staging and cache memory carved out of mem_buffer, freed blocks are reused
+    std::unique_ptr<region_resource_t> pool;
     std::unique_ptr<rpc_client> client;
+    std::unordered_map<layer_key_t, cached_layer_t, layer_key_hash_t> layer_cache;
+    std::list<layer_key_t> lru_order;
+    size_t cache_capacity, cache_used = 0;
+    bool prefetch_enabled;
+    std::optional<prefetch_t> pending;
+
+    bool cache_reserve(size_t size);
+    cached_layer_t *cache_insert(const layer_key_t &key, size_t size);
+    void cache_erase(const layer_key_t &key);
+    void complete_prefetch();
+    void prefetch_prefix(const prefix_t &prefix);
+    void stage_tensors(tensor_list_t &tensors, const uint64_list_t &encodings,
+		       std::vector<std::pmr::vector<char>> &staging, std::vector<segment_t> &segments,
+		       std::vector<uint8_t> &stored);
 
 public:
     py_backend(const std::string &thallium_cfg, const std::vector<std::string> &servers,
-	       size_t buffer_size = DEFAULT_BUFFER_SIZE);
+	       size_t buffer_size = DEFAULT_BUFFER_SIZE, size_t cache_size = 0, bool prefetch = false,
+	       const buffer_options_t &buffer_opts = buffer_options_t());
+    ~py_backend();
 
-    bool save_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids);
+    bool save_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids,
+                     uint64_list_t &encodings);
     bool load_layers(tensor_list_t &tensors, uint64_t model_id, uint64_list_t &layer_ids,
                     uint64_list_t &layer_owners);
     bool store_meta(uint64_t id, uint64_list_t &edges, uint64_list_t &layer_ids,
                     uint64_list_t &layer_owners, uint64_list_t &sizes, const float val_acc);
+    bool commit_model(tensor_list_t &tensors, uint64_t id, uint64_list_t &edges, uint64_list_t &layer_ids,
+                      uint64_list_t &layer_owners, uint64_list_t &sizes, const float val_acc,
+                      uint64_list_t &encodings);
     composition_t get_composition(uint64_t model_id);
     prefix_t get_prefix(uint64_list_t &edges);
+    prefix_match_list_t get_prefixes(uint64_list_t &edges, size_t k, float min_accuracy,
+                                     size_t min_prefix_len, uint64_list_t &exclude);
     bool update_ref_counter(uint64_t id, int value);
+    uint64_list_t get_ancestors(uint64_t id);
+    uint64_list_t get_descendants(uint64_t id);
+    uint64_list_t retire_subtree(uint64_t id);
+    bool export_models(uint64_list_t &ids, const std::string &path);
+    std::optional<uint64_list_t> import_models(const std::string &path);
     int shutdown();
 };
+
+/**
+ * file written by export_models, mapped privately so that the layers can be handed out as zero-copy views
+ */
+class py_model_file {
+    char *ptr = nullptr;
+    size_t length = 0;
+    model_file_meta_t meta;
+    std::unordered_map<model_id_t, size_t> model_index;
+    std::map<std::pair<vertex_t, model_id_t>, size_t> layer_index;
+
+    const model_meta_t &find_model(uint64_t id) const;
+
+public:
+    py_model_file(const std::string &path);
+    ~py_model_file();
+    py_model_file(const py_model_file &) = delete;
+    py_model_file &operator=(const py_model_file &) = delete;
+
+    uint64_list_t models() const;
+    uint64_list_t get_edges(uint64_t id) const;
+    composition_t get_composition(uint64_t id) const;
+    float get_val_acc(uint64_t id) const;
+    nanobind::ndarray<nanobind::numpy, uint8_t, nanobind::ndim<1>> get_layer(uint64_t vertex, uint64_t owner);
+};
 } // namespace dstates::ai
 
 #endif
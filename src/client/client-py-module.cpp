@@ -4,6 +4,7 @@
 #include <nanobind/ndarray.h>
 #include <nanobind/stl/bind_vector.h>
 #include <nanobind/stl/bind_map.h>
+#include <nanobind/stl/optional.h>
 #include <nanobind/stl/string.h>
 
 namespace nb = nanobind;
@@ -17,13 +18,49 @@ NB_MODULE(dstates, m) {
     nb::module_ ai = m.def_submodule("ai", "AI specific extensions of DataStates");
     nb::bind_vector<tensor_list_t>(ai, "tensor_list_t");
     nb::bind_map<composition_t>(ai, "composition_t");
+    nb::class_<prefix_match_t>(ai, "prefix_match_t")
+      .def_ro("id", &prefix_match_t::id)
+      .def_ro("prefix", &prefix_match_t::prefix)
+      .def_ro("val_acc", &prefix_match_t::val_acc);
+    nb::bind_vector<prefix_match_list_t>(ai, "prefix_match_list_t");
+    nb::enum_<layer_encoding_t>(ai, "encoding_t", nb::is_arithmetic())
+      .value("RAW", ENCODING_RAW)
+      .value("BF16", ENCODING_BF16)
+      .value("FP16", ENCODING_FP16)
+      .value("INT8", ENCODING_INT8);
+    nb::class_<buffer_options_t>(ai, "buffer_options_t")
+      .def(nb::init<>())
+      .def_rw("page_size", &buffer_options_t::page_size)
+      .def_rw("numa_node", &buffer_options_t::numa_node)
+      .def_rw("file", &buffer_options_t::file)
+      .def_rw("prefault_threads", &buffer_options_t::prefault_threads);
     nb::class_<py_backend>(ai, "evostore")
-      .def(nb::init<const std::string &, const string_list_t &, size_t>())
-      .def("save_layers", &py_backend::save_layers)
+      .def(nb::init<const std::string &, const string_list_t &, size_t, size_t, bool, const buffer_options_t &>(),
+	   "thallium_cfg"_a, "servers"_a, "buffer_size"_a = DEFAULT_BUFFER_SIZE,
+	   "cache_size"_a = 0, "prefetch"_a = false, "buffer_options"_a = buffer_options_t())
+      .def("save_layers", &py_backend::save_layers, "tensors"_a, "model_id"_a, "layer_ids"_a,
+	   "encodings"_a = uint64_list_t())
       .def("load_layers", &py_backend::load_layers)
       .def("store_meta", &py_backend::store_meta)
+      .def("commit_model", &py_backend::commit_model, "tensors"_a, "id"_a, "edges"_a, "layer_ids"_a,
+	   "layer_owners"_a, "sizes"_a, "val_acc"_a, "encodings"_a = uint64_list_t())
       .def("get_composition", &py_backend::get_composition)
       .def("get_prefix", &py_backend::get_prefix)
+      .def("get_prefixes", &py_backend::get_prefixes, "edges"_a, "k"_a = 1,
+	   "min_accuracy"_a = std::numeric_limits<float>::lowest(), "min_prefix_len"_a = 0,
+	   "exclude"_a = uint64_list_t())
       .def("update_ref_counter", &py_backend::update_ref_counter)
+      .def("get_ancestors", &py_backend::get_ancestors)
+      .def("get_descendants", &py_backend::get_descendants)
+      .def("retire_subtree", &py_backend::retire_subtree)
+      .def("export_models", &py_backend::export_models)
+      .def("import_models", &py_backend::import_models)
       .def("shutdown", &py_backend::shutdown);
+    nb::class_<py_model_file>(ai, "model_file")
+      .def(nb::init<const std::string &>(), "path"_a)
+      .def("models", &py_model_file::models)
+      .def("get_edges", &py_model_file::get_edges)
+      .def("get_composition", &py_model_file::get_composition)
+      .def("get_val_acc", &py_model_file::get_val_acc)
+      .def("get_layer", &py_model_file::get_layer, nb::rv_policy::reference_internal);
 }
@@ -1,4 +1,8 @@
 #include "dstates/ai/client.hpp"
+#include "model_file.hpp"
+#include "precision.hpp"
+#include <fcntl.h>
+#include <map>
 #include <thallium/serialization/stl/pair.hpp>
 #include <thallium/serialization/stl/string.hpp>
 #include <thallium/serialization/stl/unordered_map.hpp>
@@ -17,11 +21,18 @@ namespace dstates::ai {
 			   const std::vector<int> &provider_ids) : engine(thallium_cfg, THALLIUM_CLIENT_MODE) {
     // create RPC handles, these can be used with any provider
     _store_meta = engine.define("store_meta");
-    _get_prefix = engine.define("get_prefix");
+    _get_prefixes = engine.define("get_prefixes");
     _get_composition = engine.define("get_composition");
     _store_layers = engine.define("store_layers");
     _read_layers = engine.define("read_layers");
     _update_ref_counter = engine.define("update_ref_counter");
+    _commit_model = engine.define("commit_model");
+    _get_ancestors = engine.define("get_ancestors");
+    _get_descendants = engine.define("get_descendants");
+    _retire_subtree = engine.define("retire_subtree");
+    _get_meta = engine.define("get_meta");
+    _import_models = engine.define("import_models");
+    _abort_import = engine.define("abort_import");
     _shutdown = engine.define("shutdown");
 
     // create the providers handles
@@ -37,13 +48,13 @@ bool rpc_client::store_meta(const digraph_t &g, const composition_t &comp, const
 }
 
 bool rpc_client::store_layers(const model_id_t &id, const vertex_list_t &layer_id,
-			      const std::vector<segment_t> &segments) {
+			      const std::vector<segment_t> &segments, const std::vector<uint8_t> &encodings) {
     std::vector<size_t> layer_size(segments.size());
     for (int i = 0; i < segments.size(); i++)
 	layer_size[i] = segments[i].second;
 
     tl::bulk bulk = engine.expose(segments, tl::bulk_mode::read_write);
-    return _store_layers.on(get_provider(id))(id, layer_id, layer_size, bulk);
+    return _store_layers.on(get_provider(id))(id, layer_id, layer_size, encodings, bulk);
 }
 
 composition_t &rpc_client::get_composition(const model_id_t &id) {
@@ -59,14 +70,23 @@ composition_t &rpc_client::get_composition(const model_id_t &id) {
 }
 
 bool rpc_client::read_layers(const model_id_t &id, const vertex_list_t &layer_id,
-			     std::vector<segment_t> &segment_list, std::vector<uint64_t> &owners) {
+			     std::vector<segment_t> &segment_list, std::vector<uint64_t> &owners,
+			     const std::vector<bool> &fp32) {
+    return read_layers_async(id, layer_id, segment_list, owners, fp32).wait();
+}
+
+rpc_client::read_handle_t rpc_client::read_layers_async(const model_id_t &id, const vertex_list_t &layer_id,
+							std::vector<segment_t> &segment_list,
+							std::vector<uint64_t> &owners, const std::vector<bool> &fp32) {
     struct req_info_t {
 	vertex_list_t layer_id;
 	std::vector<segment_t> segments;
+	std::vector<size_t> index;
     };
     std::unordered_map<model_id_t, req_info_t> owner_map;
-    std::vector<tl::bulk> bulks;
-    std::vector<tl::async_response> reps;
+    read_handle_t handle;
+    handle.fp32 = fp32;
+    handle.decoded.assign(layer_id.size(), false);
 
     for (int i = 0; i < layer_id.size(); i++) {
 	auto owner = owners[i];
@@ -74,14 +94,47 @@ bool rpc_client::read_layers(const model_id_t &id, const vertex_list_t &layer_id
 	auto &e = owner_map[owner];
 	e.layer_id.emplace_back(layer_id[i]);
 	e.segments.emplace_back(segment_list[i]);
+	e.index.emplace_back(i);
     }
     for (auto &e : owner_map) {
-	bulks.emplace_back(engine.expose(e.second.segments, tl::bulk_mode::write_only));
-	reps.emplace_back(_read_layers.on(get_provider(e.first)).async(e.second.layer_id, e.first, bulks.back()));
+	std::vector<size_t> layer_size(e.second.segments.size());
+	for (int i = 0; i < layer_size.size(); i++)
+	    layer_size[i] = e.second.segments[i].second;
+	handle.bulks.emplace_back(engine.expose(e.second.segments, tl::bulk_mode::write_only));
+	handle.reps.emplace_back(_read_layers.on(get_provider(e.first)).async(e.second.layer_id, e.first, layer_size,
+									     handle.bulks.back()));
+	handle.segments.emplace_back(std::move(e.second.segments));
+	handle.index.emplace_back(std::move(e.second.index));
     }
+    return handle;
+}
+
+bool rpc_client::read_handle_t::wait() {
+    // wait for every owner even on failure, the remote side may still write into the bulks
     bool result = true;
-    for (auto &rep : reps)
-	result = result && rep.wait();
+    for (int i = 0; i < reps.size(); i++) {
+	read_reply_t reply = reps[i].wait();
+	result = result && reply.ok;
+	if (!reply.ok)
+	    continue;
+	for (int j = 0; j < reply.encodings.size(); j++) {
+	    if (reply.encodings[j] == ENCODING_RAW)
+		continue;
+	    auto &segment = segments[i][j];
+	    size_t k = index[i][j];
+	    if ((!fp32.empty() && !fp32[k]) ||
+		!decode_layer((layer_encoding_t)reply.encodings[j], (char *)segment.first, segment.second, reply.sizes[j])) {
+		DBG("cannot decode a layer of " << reply.sizes[j] << " bytes into a segment of " << segment.second << " bytes");
+		result = false;
+		continue;
+	    }
+	    decoded[k] = true;
+	}
+    }
+    reps.clear();
+    bulks.clear();
+    segments.clear();
+    index.clear();
     return result;
 }
 
@@ -101,17 +154,236 @@ bool rpc_client::update_ref_counter(const model_id_t &id, int value) {
     return result;
 }
 
+bool rpc_client::commit_model(const digraph_t &g, const composition_t &comp, const float val_acc,
+			      const vertex_list_t &layer_id, const std::vector<segment_t> &segments,
+			      const std::vector<uint8_t> &encodings) {
+    // the provider of g.id handles the ref counters of the owners it hosts, the others are taken before the
+    // commit, so that their layers cannot be released while the model is already visible
+    ref_update_t local_refs, remote_refs;
+    for (auto &e : comp) {
+	auto owner = e.second.first;
+	if (owner % providers.size() == g.id % providers.size())
+	    local_refs[owner].emplace_back(e.first);
+	else
+	    remote_refs[owner].emplace_back(e.first);
+    }
+    std::vector<tl::async_response> reps;
+    std::vector<model_id_t> owners;
+    for (auto &e : remote_refs) {
+	reps.push_back(_update_ref_counter.on(get_provider(e.first)).async(e.first, e.second, 1));
+	owners.emplace_back(e.first);
+    }
+    // each increment is all or nothing on its provider, only the successful ones are given back
+    std::unordered_map<size_t, ref_update_t> taken;
+    bool result = true;
+    for (int i = 0; i < reps.size(); i++) {
+	bool ret = reps[i].wait();
+	if (ret)
+	    taken[owners[i] % providers.size()][owners[i]] = remote_refs[owners[i]];
+	result = result && ret;
+    }
+    if (result) {
+	std::vector<size_t> layer_size(segments.size());
+	for (int i = 0; i < segments.size(); i++)
+	    layer_size[i] = segments[i].second;
+	tl::bulk bulk;
+	if (!segments.empty())
+	    bulk = engine.expose(segments, tl::bulk_mode::read_only);
+	result = _commit_model.on(get_provider(g.id))(g, comp, val_acc, local_refs, layer_id, layer_size, encodings, bulk);
+    }
+    if (!result) {
+	reps.clear();
+	for (auto &[provider, releases] : taken)
+	    reps.emplace_back(_retire_subtree.on(providers[provider]).async(model_id_list_t(), releases));
+	for (auto &rep : reps)
+	    rep.wait();
+	return false;
+    }
+    std::unique_lock lock(cache_lock);
+    comp_cache[g.id] = comp;
+    return true;
+}
+
 prefix_t rpc_client::get_prefix(const digraph_t &child) {
-    prefix_t max_result;
+    auto matches = get_prefixes(child, prefix_query_t());
+    if (matches.empty())
+	return prefix_t();
+    return std::make_pair(matches[0].id, std::move(matches[0].prefix));
+}
+
+prefix_match_list_t rpc_client::get_prefixes(const digraph_t &child, const prefix_query_t &query) {
+    prefix_match_list_t result;
     std::vector<tl::async_response> requests;
     for (auto &provider : providers)
-	requests.emplace_back(_get_prefix.on(provider).async(child));
+	requests.emplace_back(_get_prefixes.on(provider).async(child, query));
     for (auto &request : requests) {
-	prefix_t result = request.wait();
-	if (result.second.size() > max_result.second.size())
-	    std::swap(result, max_result);
+	prefix_match_list_t matches = request.wait();
+	for (auto &m : matches)
+	    insert_match(result, std::move(m), query.k);
+    }
+    return result;
+}
+
+model_id_list_t rpc_client::lineage_closure(tl::remote_procedure &rpc, const model_id_t &id) {
+    // each provider only knows the edges of the models it hosts, so we iterate until no provider finds new ones
+    std::unordered_set<model_id_t> visited{id};
+    model_id_list_t frontier{id}, result;
+    while (!frontier.empty()) {
+	std::vector<tl::async_response> reps;
+	for (auto &provider : providers)
+	    reps.emplace_back(rpc.on(provider).async(frontier));
+	frontier.clear();
+	for (auto &rep : reps) {
+	    model_id_list_t ids = rep.wait();
+	    for (auto &m : ids)
+		if (visited.insert(m).second) {
+		    result.emplace_back(m);
+		    frontier.emplace_back(m);
+		}
+	}
+	if (providers.size() == 1)
+	    break;
+    }
+    return result;
+}
+
+model_id_list_t rpc_client::get_ancestors(const model_id_t &id) {
+    return lineage_closure(_get_ancestors, id);
+}
+
+model_id_list_t rpc_client::get_descendants(const model_id_t &id) {
+    return lineage_closure(_get_descendants, id);
+}
+
+model_id_list_t rpc_client::retire_subtree(const model_id_t &id) {
+    std::unordered_set<model_id_t> visited{id};
+    model_id_list_t roots{id}, retired;
+    std::unordered_map<size_t, ref_update_t> remote;
+    while (!roots.empty()) {
+	std::vector<tl::async_response> reps;
+	for (auto &provider : providers)
+	    reps.emplace_back(_retire_subtree.on(provider).async(roots, ref_update_t()));
+	roots.clear();
+	for (auto &rep : reps) {
+	    std::pair<model_id_list_t, ref_update_t> result = rep.wait();
+	    for (auto &m : result.first) {
+		retired.emplace_back(m);
+		if (visited.insert(m).second)
+		    roots.emplace_back(m);
+	    }
+	    for (auto &[owner, vertices] : result.second) {
+		if (providers.size() == 1)
+		    break;
+		auto &dest = remote[owner % providers.size()][owner];
+		dest.insert(dest.end(), vertices.begin(), vertices.end());
+	    }
+	}
+	if (providers.size() == 1)
+	    break;
     }
-    return max_result;
+    // layers inherited from models hosted by other providers are released there
+    std::vector<tl::async_response> reps;
+    for (auto &[provider, releases] : remote)
+	reps.emplace_back(_retire_subtree.on(providers[provider]).async(model_id_list_t(), releases));
+    for (auto &rep : reps)
+	rep.wait();
+    std::unique_lock lock(cache_lock);
+    for (auto &m : retired)
+	comp_cache.erase(m);
+    return retired;
+}
+
+bool rpc_client::export_models(const model_id_list_t &ids, const std::string &path) {
+    model_file_meta_t meta;
+    // layers grouped by owner, so that each owner is read with a single request
+    std::map<model_id_t, std::map<vertex_t, size_t>> owners;
+    for (auto &id : ids) {
+	model_meta_t m = _get_meta.on(get_provider(id))(id);
+	if (!m.ok) {
+	    DBG("cannot export unknown model " << id);
+	    return false;
+	}
+	for (auto &[v, e] : m.composition)
+	    owners[e.first].emplace(v, e.second);
+	meta.models.emplace_back(std::move(m));
+    }
+    for (auto &[owner, layers] : owners)
+	for (auto &[v, size] : layers)
+	    meta.layers.emplace_back(model_file_layer_t{v, owner, 0, size});
+    model_file_header_t header;
+    std::string packed;
+    size_t file_size = meta.layout(header, packed);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+	return false;
+    bool result = ftruncate(fd, file_size) == 0 && pwrite_all(fd, (const char *)&header, sizeof(header), 0) &&
+	pwrite_all(fd, packed.data(), packed.size(), sizeof(header));
+    auto layer = meta.layers.begin();
+    for (auto it = owners.begin(); result && it != owners.end(); it++) {
+	auto first = layer;
+	size_t total = 0;
+	for (auto &e : it->second)
+	    total += e.second;
+	std::vector<char> buf(total);
+	std::vector<segment_t> segments;
+	vertex_list_t layer_id;
+	for (size_t offset = 0; layer != meta.layers.end() && layer->owner == it->first; offset += layer->size, layer++) {
+	    segments.emplace_back(buf.data() + offset, layer->size);
+	    layer_id.emplace_back(layer->vertex);
+	}
+	std::vector<uint64_t> layer_owners(layer_id.size(), it->first);
+	result = read_layers(it->first, layer_id, segments, layer_owners);
+	for (size_t offset = 0; result && first != layer; offset += first->size, first++)
+	    result = pwrite_all(fd, buf.data() + offset, first->size, first->offset);
+    }
+    return close(fd) == 0 && result;
+}
+
+bool rpc_client::import_models(const std::string &path, model_id_list_t &imported) {
+    model_file_header_t header;
+    model_file_meta_t meta;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+	return false;
+    bool result = meta.read(fd, header);
+    close(fd);
+    if (!result)
+	return false;
+    // the servers need to know which models exist anywhere, so that only the new ones add references
+    std::vector<tl::async_response> reps;
+    for (auto &m : meta.models)
+	reps.emplace_back(_get_meta.on(get_provider(m.graph.id)).async(m.graph.id));
+    model_id_list_t existing;
+    for (int i = 0; i < reps.size(); i++) {
+	model_meta_t m = reps[i].wait();
+	if (m.ok)
+	    existing.emplace_back(meta.models[i].graph.id);
+    }
+    reps.clear();
+    for (uint32_t i = 0; i < providers.size(); i++)
+	reps.emplace_back(_import_models.on(providers[i]).async(path, (uint32_t)providers.size(), i, existing));
+    // a provider either takes its whole share or nothing, so only the successful ones need to be undone
+    std::vector<bool> done(providers.size());
+    model_id_list_t ids;
+    for (uint32_t i = 0; i < providers.size(); i++) {
+	std::pair<bool, model_id_list_t> ret = reps[i].wait();
+	done[i] = ret.first;
+	result = result && ret.first;
+	ids.insert(ids.end(), ret.second.begin(), ret.second.end());
+    }
+    if (result) {
+	imported.insert(imported.end(), ids.begin(), ids.end());
+	return true;
+    }
+    // the models on one provider reference layers on the others, the import is all or nothing
+    reps.clear();
+    for (uint32_t i = 0; i < providers.size(); i++)
+	if (done[i])
+	    reps.emplace_back(_abort_import.on(providers[i]).async(path, (uint32_t)providers.size(), i, existing));
+    for (auto &rep : reps)
+	rep.wait();
+    return false;
 }
 
 int rpc_client::shutdown() {
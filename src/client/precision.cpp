@@ -0,0 +1,150 @@
+#include "precision.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace dstates::ai {
+
+// the kernels work on fixed size blocks that the compiler turns into vector code; a block is always
+// loaded before it is stored, which makes the in place decoding from the end of the buffer safe
+static const size_t BLOCK = 16;
+// int8 layout: [uint64_t channels][float scales[channels]][int8_t values[n]]
+static const size_t INT8_HEADER = sizeof(uint64_t);
+
+static inline uint16_t to_bf16(uint32_t x) {
+    // round to nearest even, NaNs stay quiet NaNs
+    uint16_t rounded = (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+    return (x & 0x7fffffff) > 0x7f800000 ? (uint16_t)((x >> 16) | 0x40) : rounded;
+}
+
+static inline uint32_t from_bf16(uint16_t h) {
+    return (uint32_t)h << 16;
+}
+
+static inline uint16_t to_fp16(uint32_t x) {
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+    // overflow to inf, NaN to quiet NaN
+    uint32_t special = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+    // subnormal halves: let the fp32 adder align the mantissa and round it
+    const uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+    uint32_t subnormal = std::bit_cast<uint32_t>(std::bit_cast<float>(x) + std::bit_cast<float>(denorm_magic)) - denorm_magic;
+    // normal halves: rebias the exponent and round to nearest even
+    uint32_t normal = (x + ((uint32_t)(15 - 127) << 23) + 0xfff + ((x >> 13) & 1)) >> 13;
+    uint32_t h = x >= ((127 + 16) << 23) ? special : x < (113u << 23) ? subnormal : normal;
+    return h | (sign >> 16);
+}
+
+static inline uint32_t from_fp16(uint16_t h) {
+    const uint32_t shifted_exp = 0x7c00 << 13;
+    uint32_t x = (uint32_t)(h & 0x7fff) << 13;
+    uint32_t exp = x & shifted_exp;
+    x += (127 - 15) << 23;
+    // inf/NaN get the maximal exponent, subnormals are renormalized by the fp32 subtraction
+    uint32_t special = x + ((128 - 16) << 23);
+    uint32_t subnormal = std::bit_cast<uint32_t>(std::bit_cast<float>(x + (1 << 23)) - std::bit_cast<float>(113u << 23));
+    x = exp == shifted_exp ? special : exp == 0 ? subnormal : x;
+    return x | ((uint32_t)(h & 0x8000) << 16);
+}
+
+template<typename T, typename F> static void convert(const char *src, char *dst, size_t n, F &&f) {
+    typedef std::invoke_result_t<F, T> U;
+    size_t i = 0;
+    for (; i + BLOCK <= n; i += BLOCK) {
+	T in[BLOCK];
+	U out[BLOCK];
+	std::memcpy(in, src + i * sizeof(T), sizeof(in));
+	for (size_t j = 0; j < BLOCK; j++)
+	    out[j] = f(in[j]);
+	std::memcpy(dst + i * sizeof(U), out, sizeof(out));
+    }
+    for (; i < n; i++) {
+	T in;
+	std::memcpy(&in, src + i * sizeof(T), sizeof(T));
+	U out = f(in);
+	std::memcpy(dst + i * sizeof(U), &out, sizeof(U));
+    }
+}
+
+size_t encoded_size(layer_encoding_t encoding, size_t n, size_t channels) {
+    size_t size;
+    switch (encoding) {
+    case ENCODING_BF16:
+    case ENCODING_FP16:
+	size = n * sizeof(uint16_t);
+	break;
+    case ENCODING_INT8:
+	size = INT8_HEADER + channels * sizeof(float) + n;
+	break;
+    default:
+	return 0;
+    }
+    return size < n * sizeof(float) ? size : 0;
+}
+
+void encode_layer(layer_encoding_t encoding, const float *src, size_t n, size_t channels, char *dst) {
+    const char *in = (const char *)src;
+    if (encoding == ENCODING_BF16)
+	convert<uint32_t>(in, dst, n, to_bf16);
+    else if (encoding == ENCODING_FP16)
+	convert<uint32_t>(in, dst, n, to_fp16);
+    else if (encoding == ENCODING_INT8) {
+	uint64_t header = channels;
+	size_t per_channel = n / channels;
+	std::memcpy(dst, &header, INT8_HEADER);
+	char *values = dst + INT8_HEADER + channels * sizeof(float);
+	for (size_t c = 0; c < channels; c++) {
+	    const char *first = in + c * per_channel * sizeof(float);
+	    // max of |x| on the bit patterns, which order like the values and vectorize as integers
+	    uint32_t max_bits = 0;
+	    for (size_t i = 0; i < per_channel; i++) {
+		uint32_t x;
+		std::memcpy(&x, first + i * sizeof(float), sizeof(x));
+		max_bits = std::max(max_bits, x & 0x7fffffff);
+	    }
+	    float scale = std::bit_cast<float>(max_bits) / 127;
+	    float inv = scale > 0 ? 1 / scale : 0;
+	    std::memcpy(dst + INT8_HEADER + c * sizeof(float), &scale, sizeof(scale));
+	    convert<float>(first, values + c * per_channel, per_channel, [inv](float x) {
+		float r = std::clamp(x * inv, -127.0f, 127.0f);
+		return (int8_t)(r + (r >= 0 ? 0.5f : -0.5f));
+	    });
+	}
+    }
+}
+
+bool decode_layer(layer_encoding_t encoding, char *buf, size_t size, size_t stored) {
+    size_t n = size / sizeof(float);
+    if (size % sizeof(float) != 0 || stored > size)
+	return false;
+    char *in = buf + size - stored;
+    if (encoding == ENCODING_BF16 || encoding == ENCODING_FP16) {
+	if (stored != n * sizeof(uint16_t))
+	    return false;
+	if (encoding == ENCODING_BF16)
+	    convert<uint16_t>(in, buf, n, from_bf16);
+	else
+	    convert<uint16_t>(in, buf, n, from_fp16);
+    } else if (encoding == ENCODING_INT8) {
+	uint64_t channels;
+	if (stored < INT8_HEADER)
+	    return false;
+	std::memcpy(&channels, in, INT8_HEADER);
+	if (channels == 0 || n % channels != 0 || stored != encoded_size(encoding, n, channels))
+	    return false;
+	// the scales are overwritten by the first values, save them before
+	std::vector<float> scales(channels);
+	std::memcpy(scales.data(), in + INT8_HEADER, channels * sizeof(float));
+	const char *values = in + INT8_HEADER + channels * sizeof(float);
+	size_t per_channel = n / channels;
+	for (size_t c = 0; c < channels; c++)
+	    convert<int8_t>(values + c * per_channel, buf + c * per_channel * sizeof(float), per_channel,
+			    [scale = scales[c]](int8_t q) { return q * scale; });
+    } else
+	return false;
+    return true;
+}
+} // namespace dstates::ai
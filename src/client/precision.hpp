@@ -0,0 +1,23 @@
+#ifndef __DSTATES_AI_PRECISION_HPP
+#define __DSTATES_AI_PRECISION_HPP
+
+#include "dstates/ai/types.hpp"
+
+namespace dstates::ai {
+/**
+ * bytes needed to store n fp32 values split in the given number of channels, 0 if the encoding
+ * would not save anything and the layer should be stored raw instead
+ */
+size_t encoded_size(layer_encoding_t encoding, size_t n, size_t channels);
+/**
+ * encode n fp32 values from src into dst, which holds encoded_size() bytes
+ */
+void encode_layer(layer_encoding_t encoding, const float *src, size_t n, size_t channels, char *dst);
+/**
+ * decode in place a layer whose stored bytes were written at the end of the size bytes of buf; fails
+ * without touching buf unless the decoded fp32 values fill it exactly
+ */
+bool decode_layer(layer_encoding_t encoding, char *buf, size_t size, size_t stored);
+} // namespace dstates::ai
+
+#endif //__DSTATES_AI_PRECISION_HPP
@@ -0,0 +1,207 @@
+#ifndef __DSTATES_AI_MODEL_FILE_HPP
+#define __DSTATES_AI_MODEL_FILE_HPP
+
+#include "dstates/ai/types.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace dstates::ai {
+
+/**
+ * exported population: this header, the metadata of the models and the layer table, then the layers,
+ * each at an offset aligned to the header alignment so that they can be mapped or read directly;
+ * layers shared by several models are stored once, decoded to their full size
+ */
+struct model_file_header_t {
+    static constexpr char MAGIC[8] = {'E', 'V', 'O', 'S', 'T', 'O', 'R', 'E'};
+    static const uint32_t VERSION = 1;
+    static const uint32_t ALIGNMENT = 4096;
+
+    char magic[8];
+    uint32_t version = VERSION, alignment = ALIGNMENT;
+    /// size of the metadata that follows the header
+    uint64_t meta_size = 0;
+    /// offset of the first layer
+    uint64_t data_offset = 0;
+};
+
+/**
+ * where a layer lives in the file
+ */
+struct model_file_layer_t {
+    vertex_t vertex;
+    model_id_t owner;
+    uint64_t offset, size;
+};
+
+/**
+ * pread/pwrite until size bytes are transferred, false on error or end of file
+ */
+template<typename F> bool transfer_all(F &&f, char *buf, size_t size, size_t offset) {
+    while (size > 0) {
+	ssize_t ret = f(buf, size, offset);
+	if (ret <= 0) {
+	    if (ret < 0 && errno == EINTR)
+		continue;
+	    return false;
+	}
+	buf += ret;
+	offset += ret;
+	size -= ret;
+    }
+    return true;
+}
+
+inline bool pread_all(int fd, char *buf, size_t size, size_t offset) {
+    return transfer_all([fd](char *b, size_t n, size_t o) { return pread(fd, b, n, o); }, buf, size, offset);
+}
+
+inline bool pwrite_all(int fd, const char *buf, size_t size, size_t offset) {
+    return transfer_all([fd](char *b, size_t n, size_t o) { return pwrite(fd, b, n, o); }, (char *)buf, size,
+			offset);
+}
+
+/**
+ * metadata block of a model file, the layers are sorted by offset
+ */
+struct model_file_meta_t {
+    std::vector<model_meta_t> models;
+    std::vector<model_file_layer_t> layers;
+
+    /**
+     * assign aligned offsets to the layers after the metadata and fill in the header, returns the file size
+     */
+    size_t layout(model_file_header_t &header, std::string &packed) {
+	size_t align = header.alignment, offset = 0;
+	for (auto &l : layers) {
+	    l.offset = offset;
+	    offset += (l.size + align - 1) / align * align;
+	}
+	// the offsets are stored in the metadata, so its size does not depend on their values
+	packed = pack();
+	std::memcpy(header.magic, model_file_header_t::MAGIC, sizeof(header.magic));
+	header.meta_size = packed.size();
+	header.data_offset = (sizeof(header) + packed.size() + align - 1) / align * align;
+	for (auto &l : layers)
+	    l.offset += header.data_offset;
+	packed = pack();
+	return header.data_offset + offset;
+    }
+
+    std::string pack() const {
+	std::string out;
+	auto put = [&out](auto v) { out.append((const char *)&v, sizeof(v)); };
+	put((uint64_t)models.size());
+	for (auto &m : models) {
+	    put(m.graph.id);
+	    put(m.graph.root);
+	    put(m.val_acc);
+	    put((uint64_t)m.graph.out_edges.size());
+	    for (auto &[u, out_v] : m.graph.out_edges) {
+		put(u);
+		put((uint64_t)out_v.size());
+		for (auto &v : out_v)
+		    put(v);
+	    }
+	    put((uint64_t)m.graph.in_degree.size());
+	    for (auto &[v, degree] : m.graph.in_degree) {
+		put(v);
+		put(degree);
+	    }
+	    put((uint64_t)m.composition.size());
+	    for (auto &[v, e] : m.composition) {
+		put(v);
+		put(e.first);
+		put((uint64_t)e.second);
+	    }
+	}
+	put((uint64_t)layers.size());
+	for (auto &l : layers)
+	    put(l);
+	return out;
+    }
+
+    bool unpack(const char *buf, size_t size) {
+	size_t pos = 0;
+	auto get = [&](auto &v) {
+	    if (pos + sizeof(v) > size)
+		return false;
+	    std::memcpy(&v, buf + pos, sizeof(v));
+	    pos += sizeof(v);
+	    return true;
+	};
+	// counts are checked against the size, so that a corrupted file cannot trigger huge allocations
+	uint64_t n, count, degree_count;
+	if (!get(n) || n > size)
+	    return false;
+	models.resize(n);
+	for (auto &m : models) {
+	    m.ok = true;
+	    if (!get(m.graph.id) || !get(m.graph.root) || !get(m.val_acc) || !get(count))
+		return false;
+	    for (uint64_t i = 0; i < count; i++) {
+		vertex_t u, v;
+		if (!get(u) || !get(degree_count))
+		    return false;
+		auto &out_v = m.graph.out_edges[u];
+		for (uint64_t j = 0; j < degree_count; j++) {
+		    if (!get(v))
+			return false;
+		    out_v.insert(v);
+		}
+	    }
+	    if (!get(count))
+		return false;
+	    for (uint64_t i = 0; i < count; i++) {
+		vertex_t v;
+		int degree;
+		if (!get(v) || !get(degree))
+		    return false;
+		m.graph.in_degree[v] = degree;
+	    }
+	    if (!get(count))
+		return false;
+	    for (uint64_t i = 0; i < count; i++) {
+		vertex_t v;
+		model_id_t owner;
+		uint64_t layer_size;
+		if (!get(v) || !get(owner) || !get(layer_size))
+		    return false;
+		m.composition.emplace(v, std::make_pair(owner, layer_size));
+	    }
+	}
+	if (!get(n) || n > size)
+	    return false;
+	layers.resize(n);
+	for (auto &l : layers)
+	    if (!get(l))
+		return false;
+	return pos == size;
+    }
+
+    /**
+     * read and check the header and the metadata of an open model file
+     */
+    bool read(int fd, model_file_header_t &header) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !pread_all(fd, (char *)&header, sizeof(header), 0) ||
+	    std::memcmp(header.magic, model_file_header_t::MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != model_file_header_t::VERSION || sizeof(header) + header.meta_size > (size_t)st.st_size)
+	    return false;
+	std::vector<char> buf(header.meta_size);
+	if (!pread_all(fd, buf.data(), buf.size(), sizeof(header)) || !unpack(buf.data(), buf.size()))
+	    return false;
+	for (auto &l : layers)
+	    if (l.offset < header.data_offset || l.offset + l.size > (size_t)st.st_size)
+		return false;
+	return true;
+    }
+};
+} // namespace dstates::ai
+
+#endif //__DSTATES_AI_MODEL_FILE_HPP
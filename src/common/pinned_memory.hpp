@@ -0,0 +1,137 @@
+#ifndef __DSTATES_AI_PINNED_MEMORY_HPP
+#define __DSTATES_AI_PINNED_MEMORY_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/mman.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace dstates::ai {
+
+/**
+ * how the large staging/pinned buffers are backed
+ */
+struct buffer_options_t {
+    /// 0 for regular pages, otherwise the huge page size: 2 MiB or 1 GiB
+    size_t page_size = 0;
+    /// bind the pages to this NUMA node, -1 keeps the default policy
+    int numa_node = -1;
+    /// map this file instead of anonymous memory, so the buffer can exceed the physical memory
+    std::string file;
+    /// threads populating the pages at startup, 0 populates them lazily on first touch
+    unsigned int prefault_threads = 0;
+};
+
+/**
+ * memory region mapped according to buffer_options_t, throws std::runtime_error if it cannot be mapped
+ */
+class pinned_buffer_t {
+    char *ptr = nullptr;
+    size_t length = 0;
+
+    static void check(bool ok, const std::string &what) {
+	if (!ok)
+	    throw std::runtime_error("pinned buffer: " + what + ": " + std::strerror(errno));
+    }
+
+public:
+    pinned_buffer_t(size_t size, const buffer_options_t &opts) {
+	size_t page = opts.page_size > 0 ? opts.page_size : sysconf(_SC_PAGESIZE);
+	length = (size + page - 1) / page * page;
+	int fd = -1, flags;
+	if (!opts.file.empty()) {
+	    fd = open(opts.file.c_str(), O_RDWR | O_CREAT, 0600);
+	    check(fd >= 0, "cannot open " + opts.file);
+	    if (ftruncate(fd, length) != 0) {
+		close(fd);
+		check(false, "cannot resize " + opts.file);
+	    }
+	    // on hugetlbfs the page size comes from the mount
+	    flags = MAP_SHARED;
+	} else {
+	    // huge pages are reserved upfront, otherwise running out of them raises SIGBUS on first touch
+	    flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	    if (opts.page_size == 0)
+		flags |= MAP_NORESERVE;
+	    else if (opts.page_size == (1ul << 21))
+		flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+	    else if (opts.page_size == (1ul << 30))
+		flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+	    else
+		throw std::runtime_error("pinned buffer: unsupported huge page size " + std::to_string(opts.page_size));
+	}
+	void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (fd >= 0)
+	    close(fd);
+	check(addr != MAP_FAILED, "cannot map " + std::to_string(length) + " bytes");
+	ptr = (char *)addr;
+	try {
+	    if (opts.numa_node >= 0) {
+		// raw syscall, so that we do not depend on libnuma; MPOL_BIND = 2
+		const size_t bits = 8 * sizeof(unsigned long);
+		std::vector<unsigned long> mask(opts.numa_node / bits + 1, 0);
+		mask[opts.numa_node / bits] |= 1ul << (opts.numa_node % bits);
+		check(syscall(SYS_mbind, ptr, length, 2, mask.data(), mask.size() * bits + 1, 0) == 0,
+		      "cannot bind to NUMA node " + std::to_string(opts.numa_node));
+	    }
+	    if (opts.prefault_threads > 0)
+		prefault(page, opts.prefault_threads);
+	} catch (std::runtime_error &e) {
+	    munmap(ptr, length);
+	    throw;
+	}
+    }
+
+    ~pinned_buffer_t() {
+	if (ptr != nullptr)
+	    munmap(ptr, length);
+    }
+
+    pinned_buffer_t(const pinned_buffer_t &) = delete;
+    pinned_buffer_t &operator=(const pinned_buffer_t &) = delete;
+
+    char *data() const { return ptr; }
+    size_t size() const { return length; }
+
+    /**
+     * populate the pages in parallel, each thread gets a contiguous range of whole pages
+     */
+    void prefault(size_t page, unsigned int threads) {
+	size_t pages = length / page, chunk = (pages + threads - 1) / threads;
+	std::vector<std::thread> workers;
+	std::vector<int> errors(threads, 0);
+	for (size_t first = 0, i = 0; first < pages; first += chunk, i++)
+	    workers.emplace_back([this, page, first, last = std::min(first + chunk, pages), &error = errors[i]] {
+		char *begin = ptr + first * page;
+		if (madvise(begin, (last - first) * page, MADV_POPULATE_WRITE) == 0)
+		    return;
+		if (errno != EINVAL) {
+		    error = errno;
+		    return;
+		}
+		// kernels before 5.14: touch each page, keeping the content of file backed buffers
+		for (volatile char *p = begin; p < ptr + last * page; p += page)
+		    *p = *p;
+	    });
+	for (auto &w : workers)
+	    w.join();
+	for (auto &error : errors) {
+	    errno = error;
+	    check(error == 0, "cannot populate " + std::to_string(length) + " bytes");
+	}
+    }
+};
+} // namespace dstates::ai
+
+#endif //__DSTATES_AI_PINNED_MEMORY_HPP
@@ -0,0 +1,86 @@
+#ifndef __DSTATES_AI_REGION_RESOURCE_HPP
+#define __DSTATES_AI_REGION_RESOURCE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory_resource>
+#include <new>
+
+namespace dstates::ai {
+
+/**
+ * first-fit allocator over a fixed memory region, freed blocks are merged with their free neighbours so
+ * that the whole region can be reused whatever the allocation sizes; not synchronized
+ */
+class region_resource_t : public std::pmr::memory_resource {
+    static const size_t GRANULE = alignof(std::max_align_t);
+
+    char *base;
+    size_t length, allocated = 0;
+    /// offset -> size of the free blocks
+    std::map<size_t, size_t> free_blocks;
+
+    static size_t round_up(size_t x, size_t align) {
+	return (x + align - 1) / align * align;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+	size_t size = round_up(bytes == 0 ? 1 : bytes, GRANULE);
+	alignment = alignment < GRANULE ? GRANULE : alignment;
+	for (auto it = free_blocks.begin(); it != free_blocks.end(); ++it) {
+	    auto [offset, block] = *it;
+	    size_t start = round_up((uintptr_t)base + offset, alignment) - (uintptr_t)base;
+	    if (start + size > offset + block)
+		continue;
+	    free_blocks.erase(it);
+	    // the leading gap only exists for alignments above GRANULE, both leftovers stay GRANULE aligned
+	    if (start > offset)
+		free_blocks.emplace(offset, start - offset);
+	    if (start + size < offset + block)
+		free_blocks.emplace(start + size, offset + block - start - size);
+	    allocated += size;
+	    return base + start;
+	}
+	throw std::bad_alloc();
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t) override {
+	size_t offset = (char *)p - base, size = round_up(bytes == 0 ? 1 : bytes, GRANULE);
+	allocated -= size;
+	auto next = free_blocks.lower_bound(offset);
+	if (next != free_blocks.end() && offset + size == next->first) {
+	    size += next->second;
+	    next = free_blocks.erase(next);
+	}
+	if (next != free_blocks.begin()) {
+	    auto prev = std::prev(next);
+	    if (prev->first + prev->second == offset) {
+		prev->second += size;
+		return;
+	    }
+	}
+	free_blocks.emplace_hint(next, offset, size);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+	return this == &other;
+    }
+
+public:
+    region_resource_t(void *ptr, size_t size) : base((char *)ptr), length(size / GRANULE * GRANULE) {
+	if (length > 0)
+	    free_blocks.emplace(0, length);
+    }
+
+    region_resource_t(const region_resource_t &) = delete;
+    region_resource_t &operator=(const region_resource_t &) = delete;
+
+    /// bytes handed out, including the rounding to GRANULE
+    size_t used() const { return allocated; }
+    size_t capacity() const { return length; }
+};
+} // namespace dstates::ai
+
+#endif //__DSTATES_AI_REGION_RESOURCE_HPP
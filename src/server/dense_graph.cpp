@@ -0,0 +1,167 @@
+#include "dense_graph.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <deque>
+
+namespace dstates::ai {
+
+vertex_list_t get_lcp(const digraph_t &child, const digraph_t &parent) {
+    std::deque<vertex_t> frontier{child.root};
+    std::unordered_map<vertex_t, int> visits;
+    vertex_list_t prefix;
+    while (frontier.size() > 0) {
+	uint64_t u = frontier.front();
+	frontier.pop_front();
+	prefix.push_back(u);
+	auto c_it = child.out_edges.find(u);
+	if (c_it == child.out_edges.end())
+	    continue;
+	auto p_it = parent.out_edges.find(u);
+	if (p_it == parent.out_edges.end())
+	    continue;
+	for (auto const &v : c_it->second) {
+	    if (p_it->second.count(v)) {
+		visits[v]++;
+		if (visits[v] == std::max(child.in_degree.at(v), parent.in_degree.at(v)))
+		    frontier.push_back(v);
+	    }
+	}
+    }
+    return prefix;
+}
+
+uint32_t dense_catalog_t::find(vertex_t v) const {
+    auto it = index.find(v);
+    return it == index.end() ? npos : it->second;
+}
+
+uint32_t dense_catalog_t::insert(vertex_t v) {
+    auto it = index.find(v);
+    if (it != index.end())
+	return it->second;
+    if (vertices.size() == capacity)
+	return npos;
+    vertices.push_back(v);
+    index.emplace(v, vertices.size() - 1);
+    return vertices.size() - 1;
+}
+
+static void make_rank(const std::vector<uint64_t> &bits, std::vector<uint32_t> &ranks) {
+    ranks.resize(bits.size());
+    uint32_t count = 0;
+    for (size_t w = 0; w < bits.size(); w++) {
+	ranks[w] = count;
+	count += std::popcount(bits[w]);
+    }
+}
+
+bool make_dense(const digraph_t &g, dense_catalog_t &catalog, bool extend, dense_graph_t &d) {
+    auto lookup = [&](vertex_t v) { return extend ? catalog.insert(v) : catalog.find(v); };
+    size_t words = catalog.words();
+    d = dense_graph_t();
+    uint32_t root = lookup(g.root);
+    if (root == dense_catalog_t::npos)
+	return false;
+    d.sources.assign(words, 0);
+    d.targets.assign(words, 0);
+    // rows are laid out in dense index order, so that the rank of a source is its row
+    std::vector<std::pair<uint32_t, const digraph_t::vset_t *>> sources;
+    for (auto &[u, out] : g.out_edges) {
+	uint32_t du = lookup(u);
+	if (du == dense_catalog_t::npos) {
+	    if (extend)
+		return false;
+	    continue;
+	}
+	sources.emplace_back(du, &out);
+    }
+    std::sort(sources.begin(), sources.end());
+    d.adj.assign(sources.size() * words, 0);
+    for (size_t i = 0; i < sources.size(); i++) {
+	auto [du, out] = sources[i];
+	d.sources[du / 64] |= 1ull << (du % 64);
+	uint64_t *bits = &d.adj[i * words];
+	for (auto &v : *out) {
+	    uint32_t dv = lookup(v);
+	    if (dv == dense_catalog_t::npos) {
+		if (extend)
+		    return false;
+		continue;
+	    }
+	    bits[dv / 64] |= 1ull << (dv % 64);
+	}
+	d.out_offset.emplace_back(d.out.size());
+	for (size_t w = 0; w < words; w++)
+	    for (uint64_t word = bits[w]; word != 0; word &= word - 1)
+		d.out.emplace_back(w * 64 + std::countr_zero(word));
+    }
+    d.out_offset.emplace_back(d.out.size());
+    std::vector<std::pair<uint32_t, int>> targets;
+    for (auto &[v, degree] : g.in_degree) {
+	uint32_t dv = lookup(v);
+	if (dv == dense_catalog_t::npos) {
+	    if (extend)
+		return false;
+	    continue;
+	}
+	targets.emplace_back(dv, degree);
+	d.targets[dv / 64] |= 1ull << (dv % 64);
+    }
+    std::sort(targets.begin(), targets.end());
+    d.degrees.reserve(targets.size());
+    for (auto &t : targets)
+	d.degrees.emplace_back(t.second);
+    make_rank(d.sources, d.source_rank);
+    make_rank(d.targets, d.target_rank);
+    d.root = root;
+    return true;
+}
+
+size_t dense_bound(const dense_graph_t &child, const dense_graph_t &parent) {
+    const uint64_t *a = child.targets.data(), *b = parent.targets.data();
+    size_t common = 0;
+    for (size_t w = 0; w < child.targets.size(); w++)
+	common += std::popcount(a[w] & b[w]);
+    return 1 + common;
+}
+
+vertex_list_t dense_lcp(const dense_graph_t &child, const dense_graph_t &parent,
+			const dense_catalog_t &catalog, dense_scratch_t &scratch) {
+    size_t words = catalog.words();
+    // stamps avoid clearing the visit counters between parents
+    if (scratch.stamp.size() != catalog.size()) {
+	scratch.stamp.assign(catalog.size(), 0);
+	scratch.visits.assign(catalog.size(), 0);
+	scratch.epoch = 0;
+    }
+    uint32_t epoch = ++scratch.epoch;
+    // the queue doubles as the prefix, vertices are popped in the order they were pushed
+    auto &queue = scratch.queue;
+    queue.assign(1, child.root);
+    for (size_t head = 0; head < queue.size(); head++) {
+	uint32_t u = queue[head];
+	uint32_t c_row = child.row(u), p_row = parent.row(u);
+	if (c_row == dense_catalog_t::npos || p_row == dense_catalog_t::npos)
+	    continue;
+	// the out-edges of the child are walked as a list and looked up in the bitset row of the parent,
+	// so each step costs the out-degree of u rather than the size of the catalog
+	const uint64_t *bits = &parent.adj[p_row * words];
+	for (uint32_t i = child.out_offset[c_row]; i < child.out_offset[c_row + 1]; i++) {
+	    uint32_t v = child.out[i];
+	    if ((bits[v / 64] & (1ull << (v % 64))) == 0)
+		continue;
+	    if (scratch.stamp[v] != epoch) {
+		scratch.stamp[v] = epoch;
+		scratch.visits[v] = 0;
+	    }
+	    if (++scratch.visits[v] == std::max(child.in_degree(v), parent.in_degree(v)))
+		queue.push_back(v);
+	}
+    }
+    vertex_list_t prefix(queue.size());
+    for (size_t i = 0; i < queue.size(); i++)
+	prefix[i] = catalog.vertex(queue[i]);
+    return prefix;
+}
+} // namespace dstates::ai
@@ -0,0 +1,102 @@
+#ifndef __DSTATES_AI_DENSE_GRAPH_HPP
+#define __DSTATES_AI_DENSE_GRAPH_HPP
+
+#include "dstates/ai/types.hpp"
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+namespace dstates::ai {
+
+/**
+ * remaps the vertex ids of a bounded layer catalog to dense indices in [0, capacity)
+ */
+class dense_catalog_t {
+    size_t capacity;
+    std::unordered_map<vertex_t, uint32_t> index;
+    std::vector<vertex_t> vertices;
+
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    dense_catalog_t(size_t cap = 0) : capacity(cap) {}
+    bool enabled() const { return capacity > 0; }
+    size_t size() const { return capacity; }
+    /// number of 64-bit words of a bitset over the catalog
+    size_t words() const { return (capacity + 63) / 64; }
+    vertex_t vertex(uint32_t i) const { return vertices[i]; }
+    /// dense index of v, npos if unknown
+    uint32_t find(vertex_t v) const;
+    /// dense index of v, allocated on first sight, npos if the catalog is full
+    uint32_t insert(vertex_t v);
+};
+
+/**
+ * adjacency of a digraph_t as bitsets over the dense vertex space of a catalog; besides two membership
+ * bitsets, the per vertex data is only kept for the vertices of the graph, located by their rank
+ */
+struct dense_graph_t {
+    uint32_t root = dense_catalog_t::npos;
+    /// bitsets of the vertices with out-edges and of those with in-edges
+    std::vector<uint64_t> sources, targets;
+    /// set bits of sources and targets in the words before each word
+    std::vector<uint32_t> source_rank, target_rank;
+    /// out-edges, one bitset of catalog.words() words per source, in dense index order
+    std::vector<uint64_t> adj;
+    /// the same out-edges as lists of dense indices, those of row r are out[out_offset[r], out_offset[r + 1])
+    std::vector<uint32_t> out_offset, out;
+    /// in-degree of each target, in dense index order
+    std::vector<int> degrees;
+
+    bool empty() const { return root == dense_catalog_t::npos; }
+    /// row of v in adj, npos if it has no out-edges
+    uint32_t row(uint32_t v) const { return rank(sources, source_rank, v); }
+    /// in-degree of v, 0 if it has no in-edges
+    int in_degree(uint32_t v) const {
+	uint32_t i = rank(targets, target_rank, v);
+	return i == dense_catalog_t::npos ? 0 : degrees[i];
+    }
+
+private:
+    static uint32_t rank(const std::vector<uint64_t> &bits, const std::vector<uint32_t> &ranks, uint32_t v) {
+	uint64_t word = bits[v / 64], bit = 1ull << (v % 64);
+	if ((word & bit) == 0)
+	    return dense_catalog_t::npos;
+	return ranks[v / 64] + std::popcount(word & (bit - 1));
+    }
+};
+
+/**
+ * per query scratch space of dense_lcp, reused across parents
+ */
+struct dense_scratch_t {
+    uint32_t epoch = 0;
+    std::vector<uint32_t> stamp;
+    std::vector<int> visits;
+    std::vector<uint32_t> queue;
+};
+
+/**
+ * build the dense form of g; with extend the catalog learns the new vertices and the build fails
+ * (leaving d empty) if it is full, without it edges to unknown vertices are dropped since they
+ * cannot be part of any prefix
+ */
+bool make_dense(const digraph_t &g, dense_catalog_t &catalog, bool extend, dense_graph_t &d);
+/**
+ * upper bound of the prefix length: the root plus the vertices with in-edges in both graphs
+ */
+size_t dense_bound(const dense_graph_t &child, const dense_graph_t &parent);
+/**
+ * generalized longest common prefix of child and parent, walked on the hash maps of the original graphs
+ */
+vertex_list_t get_lcp(const digraph_t &child, const digraph_t &parent);
+/**
+ * generalized longest common prefix on the dense forms, the same vertices as get_lcp but not necessarily
+ * in the same order, since the common out-edges of a vertex are visited in dense index order
+ */
+vertex_list_t dense_lcp(const dense_graph_t &child, const dense_graph_t &parent,
+			const dense_catalog_t &catalog, dense_scratch_t &scratch);
+} // namespace dstates::ai
+
+#endif //__DSTATES_AI_DENSE_GRAPH_HPP
@@ -1,7 +1,11 @@
 #include "server.hpp"
+#include "model_file.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <chrono>
-#include <deque>
+#include <fcntl.h>
+#include <map>
 #include <thallium/serialization/stl/pair.hpp>
 #include <thallium/serialization/stl/string.hpp>
 #include <thallium/serialization/stl/unordered_map.hpp>
@@ -14,21 +18,76 @@
 logger_state_t logger_state;
 
 namespace dstates::ai {
-model_server_t::model_server_t(tl::engine &e, uint16_t provider_id, uint32_t num_procs,
-			       size_t buffer_size, std::string const &server_policy)
+// upper bound of the get_lcp length: the root plus the vertices with in-edges in both graphs
+static size_t sparse_bound(const digraph_t &child, const digraph_t &parent) {
+    auto &small = child.in_degree.size() < parent.in_degree.size() ? child.in_degree : parent.in_degree;
+    auto &large = &small == &child.in_degree ? parent.in_degree : child.in_degree;
+    size_t bound = 1;
+    for (auto &e : small)
+	bound += large.contains(e.first);
+    return bound;
+}
+
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// edges are summed so that structurally identical children hash the same regardless of id and insertion order
+static size_t structure_hash(const digraph_t &g, const prefix_query_t &query) {
+    uint64_t h = mix(g.root);
+    for (auto &[u, out] : g.out_edges)
+	for (auto &v : out)
+	    h += mix(mix(u) ^ v);
+    for (auto &id : query.exclude)
+	h += mix(~id);
+    return h ^ mix(query.k) ^ mix(mix(query.min_prefix_len) ^ std::bit_cast<uint32_t>(query.min_accuracy));
+}
+
+static bool same_query(const digraph_t &a, const prefix_query_t &qa, const digraph_t &b, const prefix_query_t &qb) {
+    return a.root == b.root && qa.k == qb.k && qa.min_accuracy == qb.min_accuracy &&
+	qa.min_prefix_len == qb.min_prefix_len && a.out_edges == b.out_edges && qa.exclude == qb.exclude;
+}
+
+model_server_t::model_server_t(tl::engine &e, uint16_t provider_id, const pool_config_t &pools,
+			       size_t buffer_size, std::string const &server_policy, size_t dense_ids,
+			       size_t prefix_cache_entries, const buffer_options_t &buffer_opts)
 : tl::provider<model_server_t>(e, provider_id),
-request_pool(tl::pool::create(tl::pool::access::spmc)), pinned_buffer_size(buffer_size) {
+meta_pool(tl::pool::create(tl::pool::access::mpmc)), bulk_pool(tl::pool::create(tl::pool::access::mpmc)),
+scan_pool(tl::pool::create(tl::pool::access::mpmc)), pinned_buffer_size(buffer_size), pool_config(pools),
+buffer_options(buffer_opts), catalog(dense_ids), prefix_cache_size(prefix_cache_entries) {
     rdma_buffers_init(e);
     policy = std::move(server_policy);
-    for (int i = 0; i < num_procs; i++)
-	ess.emplace_back(tl::xstream::create(tl::scheduler::predef::deflt, *request_pool));
-    procedures.emplace_back(define("store_meta", &model_server_t::store_meta, *request_pool));
-    procedures.emplace_back(define("get_prefix", &model_server_t::get_prefix, *request_pool));
-    procedures.emplace_back(define("get_composition", &model_server_t::get_composition, *request_pool));
-    procedures.emplace_back(define("store_layers", &model_server_t::store_layers, *request_pool));
-    procedures.emplace_back(define("read_layers", &model_server_t::read_layers, *request_pool));
-    procedures.emplace_back(define("update_ref_counter", &model_server_t::update_ref_counter, *request_pool));
-    procedures.emplace_back(define("shutdown", &model_server_t::shutdown, *request_pool));
+    // the default scheduler pops from the pools in order, so metadata requests go first on every stream,
+    // and classes without streams of their own fall back to the metadata streams
+    std::vector<tl::pool> meta_pools{*meta_pool}, bulk_pools{*meta_pool, *bulk_pool},
+	scan_pools{*meta_pool, *scan_pool};
+    if (pools.bulk_threads == 0)
+	meta_pools.emplace_back(*bulk_pool);
+    if (pools.scan_threads == 0)
+	meta_pools.emplace_back(*scan_pool);
+    for (int i = 0; i < std::max(pools.meta_threads, 1u); i++)
+	ess.emplace_back(tl::xstream::create(tl::scheduler::predef::deflt, meta_pools.begin(), meta_pools.end()));
+    for (int i = 0; i < pools.bulk_threads; i++)
+	ess.emplace_back(tl::xstream::create(tl::scheduler::predef::deflt, bulk_pools.begin(), bulk_pools.end()));
+    for (int i = 0; i < pools.scan_threads; i++)
+	ess.emplace_back(tl::xstream::create(tl::scheduler::predef::deflt, scan_pools.begin(), scan_pools.end()));
+    procedures.emplace_back(define("store_meta", &model_server_t::store_meta, *meta_pool));
+    procedures.emplace_back(define("get_prefix", &model_server_t::get_prefix, *scan_pool));
+    procedures.emplace_back(define("get_prefixes", &model_server_t::get_prefixes, *scan_pool));
+    procedures.emplace_back(define("get_composition", &model_server_t::get_composition, *meta_pool));
+    procedures.emplace_back(define("get_meta", &model_server_t::get_meta, *meta_pool));
+    procedures.emplace_back(define("store_layers", &model_server_t::store_layers, *bulk_pool));
+    procedures.emplace_back(define("read_layers", &model_server_t::read_layers, *bulk_pool));
+    procedures.emplace_back(define("update_ref_counter", &model_server_t::update_ref_counter, *meta_pool));
+    procedures.emplace_back(define("commit_model", &model_server_t::commit_model, *bulk_pool));
+    procedures.emplace_back(define("get_ancestors", &model_server_t::get_ancestors, *meta_pool));
+    procedures.emplace_back(define("get_descendants", &model_server_t::get_descendants, *meta_pool));
+    procedures.emplace_back(define("retire_subtree", &model_server_t::retire_subtree, *meta_pool));
+    procedures.emplace_back(define("import_models", &model_server_t::import_models, *bulk_pool));
+    procedures.emplace_back(define("abort_import", &model_server_t::abort_import, *bulk_pool));
+    procedures.emplace_back(define("shutdown", &model_server_t::shutdown, *meta_pool));
     get_engine().push_finalize_callback(this, [p = this] { delete p; });
 }
 
@@ -44,103 +103,418 @@ model_server_t::~model_server_t() {
 bool model_server_t::store_meta(const digraph_t &g, const composition_t &comp,
                                 const float val_acc) {
     std::unique_lock lock(store_lock);
-    graph_store.emplace_back(g);
-    graph_info.try_emplace(g.id, model_info_t(std::prev(graph_store.end()), comp, val_acc));
+    return register_model(g, comp, val_acc);
+}
+
+bool model_server_t::register_model(const digraph_t &g, const composition_t &comp, const float val_acc) {
+    // models are immutable, a second registration of the same id is rejected
+    auto [it, inserted] = graph_info.try_emplace(g.id, model_info_t(graph_store.end(), comp, val_acc));
+    if (!inserted) {
+	DBG("model " << g.id << " is already registered");
+	return false;
+    }
+    it->second.index = graph_store.insert(graph_store.end(), g);
+    if (catalog.enabled() && !make_dense(g, catalog, true, it->second.dense))
+	DBG("dense id catalog is full, model " << g.id << " uses sparse prefix matching");
+    auto &node = lineage[g.id];
+    for (auto &e : comp)
+	if (e.second.first != g.id && node.parents.insert(e.second.first).second)
+	    lineage[e.second.first].children.insert(g.id);
+    // the new model is the last one get_prefixes would visit, so it only needs to be merged into each result
+    for (auto &entry : prefix_lru) {
+	auto &query = entry.query;
+	if (query.exclude.contains(g.id) || val_acc < query.min_accuracy)
+	    continue;
+	prefix_match_t match{g.id, get_lcp(entry.child, g), val_acc};
+	if (match.prefix.size() >= query.min_prefix_len)
+	    insert_match(entry.result, std::move(match), query.k);
+    }
     return true;
 }
 
+void model_server_t::retire_model(const model_id_t &id) {
+    auto it = graph_info.find(id);
+    if (it == graph_info.end())
+	return;
+    graph_store.erase(it->second.index);
+    graph_info.erase(it);
+    for (auto entry = prefix_lru.begin(); entry != prefix_lru.end();) {
+	auto next = std::next(entry);
+	for (auto &m : entry->result)
+	    if (m.id == id) {
+		prefix_cache_erase(entry);
+		break;
+	    }
+	entry = next;
+    }
+    lineage_prune(id);
+    DBG("retired model " << id);
+}
+
+void model_server_t::lineage_prune(const model_id_t &id) {
+    // a worklist rather than recursion, retiring a model can collapse a chain as long as its ancestry
+    model_id_list_t pending{id};
+    while (!pending.empty()) {
+	model_id_t m = pending.back();
+	pending.pop_back();
+	auto it = lineage.find(m);
+	if (it == lineage.end() || !it->second.children.empty() || graph_info.contains(m))
+	    continue;
+	auto parents = std::move(it->second.parents);
+	lineage.erase(it);
+	for (auto &p : parents) {
+	    auto p_it = lineage.find(p);
+	    if (p_it == lineage.end())
+		continue;
+	    p_it->second.children.erase(m);
+	    pending.emplace_back(p);
+	}
+    }
+}
+
+model_id_list_t model_server_t::lineage_closure(const model_id_list_t &ids, bool ancestors) {
+    std::unordered_set<model_id_t> visited(ids.begin(), ids.end());
+    model_id_list_t frontier(ids), result;
+    while (!frontier.empty()) {
+	auto it = lineage.find(frontier.back());
+	frontier.pop_back();
+	if (it == lineage.end())
+	    continue;
+	for (auto &next : ancestors ? it->second.parents : it->second.children)
+	    if (visited.insert(next).second) {
+		result.emplace_back(next);
+		frontier.emplace_back(next);
+	    }
+    }
+    return result;
+}
+
+model_id_list_t model_server_t::get_ancestors(const model_id_list_t &ids) {
+    std::shared_lock lock(store_lock);
+    return lineage_closure(ids, true);
+}
+
+model_id_list_t model_server_t::get_descendants(const model_id_list_t &ids) {
+    std::shared_lock lock(store_lock);
+    return lineage_closure(ids, false);
+}
+
+bool model_server_t::release_layer(const vertex_t &v, const model_id_t &owner) {
+    auto it = layer_store.find(v);
+    if (it == layer_store.end())
+	return false;
+    std::unique_lock lock(it->second.layer_lock);
+    auto l_it = it->second.owner_map.find(owner);
+    if (l_it == it->second.owner_map.end())
+	return false;
+    // layers whose ref counter was never incremented are not managed by ref counting
+    if (l_it->second.ref_count > 0 && --l_it->second.ref_count == 0) {
+	release_segment(l_it->second.segment);
+	it->second.owner_map.erase(l_it);
+    }
+    return true;
+}
+
+std::pair<model_id_list_t, ref_update_t> model_server_t::retire_subtree(const model_id_list_t &roots,
+									const ref_update_t &releases) {
+    std::unique_lock lock(store_lock);
+    model_id_list_t subtree = lineage_closure(roots, false), retired;
+    subtree.insert(subtree.end(), roots.begin(), roots.end());
+    // every model releases the layers of its composition once, those hosted elsewhere go back to the client
+    ref_update_t remote;
+    for (auto &id : subtree) {
+	auto it = graph_info.find(id);
+	if (it == graph_info.end())
+	    continue;
+	for (auto &[v, e] : it->second.composition)
+	    if (!release_layer(v, e.first))
+		remote[e.first].emplace_back(v);
+	retired.emplace_back(id);
+    }
+    for (auto &[owner, vertices] : releases)
+	for (auto &v : vertices)
+	    release_layer(v, owner);
+    // drop the lineage edges inside the subtree first, so that retire_model can prune the whole branch
+    std::unordered_set<model_id_t> members(retired.begin(), retired.end());
+    for (auto &id : retired)
+	for (auto &p : lineage[id].parents)
+	    if (members.contains(p))
+		lineage[p].children.erase(id);
+    for (auto &id : retired) {
+	auto it = lineage.find(id);
+	if (it != lineage.end())
+	    std::erase_if(it->second.children, [&](auto &c) { return members.contains(c); });
+	retire_model(id);
+    }
+    return std::make_pair(retired, remote);
+}
+
+void model_server_t::prefix_cache_erase(std::list<prefix_entry_t>::iterator entry) {
+    auto range = prefix_cache.equal_range(entry->hash);
+    for (auto it = range.first; it != range.second; ++it)
+	if (it->second == entry) {
+	    prefix_cache.erase(it);
+	    break;
+	}
+    prefix_lru.erase(entry);
+}
+
 bool model_server_t::update_ref_counter(const model_id_t &owner, const vertex_list_t &layer_id, int value) {
+    // increments are all or nothing, so that a client can give back exactly what it took when a commit fails
+    auto undo = [&](int count) {
+	if (value <= 0)
+	    return;
+	std::shared_lock lock(store_lock);
+	for (int i = 0; i < count; i++)
+	    for (int j = 0; j < value; j++)
+		release_layer(layer_id[i], owner);
+    };
     for (int i = 0; i < layer_id.size(); i++) {
-	std::unique_lock lock(store_lock);
-	auto &li = layer_store[layer_id[i]];
+	std::shared_lock lock(store_lock);
+	auto l_it = layer_store.find(layer_id[i]);
+	if (l_it == layer_store.end()) {
+	    lock.unlock();
+	    undo(i);
+	    return false;
+	}
+	auto &li = l_it->second;
 	lock.unlock();
-	lock = std::unique_lock(li.layer_lock);
+	std::unique_lock layer_lock(li.layer_lock);
 	auto it = li.owner_map.find(owner);
-	if (it == li.owner_map.end())
+	if (it == li.owner_map.end()) {
+	    layer_lock.unlock();
+	    undo(i);
 	    return false;
+	}
 	it->second.ref_count += value;
 	if (it->second.ref_count <= 0) {
-	    delete (unsigned char *)it->second.segment.first;
+	    release_segment(it->second.segment);
 	    li.owner_map.erase(it);
 	}
     }
     if (value < 0) {
 	std::unique_lock lock(store_lock);
-	auto it = graph_info.find(owner);
-	if (it != graph_info.end()) {
-	    graph_store.erase(it->second.index);
-	    graph_info.erase(it);
-	    DBG("retired model " << owner);
-	}
+	retire_model(owner);
     }
     return true;
 }
 
-void model_server_t::store_layers(const tl::request &req, const model_id_t &id,
-                                  const vertex_list_t &layer_id,
-                                  const std::vector<size_t> &layer_size, tl::bulk &bulk) {
-    std::vector<layer_t> layers;
-    std::vector<segment_t> segments;
-    for (int i = 0; i < layer_id.size(); i++) {
+bool model_server_t::admit_bulk(size_t size) {
+    std::unique_lock lock(rdma_segments.buffer_lock);
+    auto full = [&] {
+	size_t used = rdma_segments.pool->used();
+	if (used + size <= pool_config.high_watermark * pinned_buffer_size)
+	    return false;
+	DBG("rejected " << size << " bytes, pinned buffer is nearly full (" << used << " bytes used)");
+	return true;
+    };
+    if (full())
+	return false;
+    if (pool_config.max_inflight > 0) {
+	rdma_segments.inflight_cv.wait(lock, [&] {
+	    return rdma_segments.inflight == 0 || rdma_segments.inflight + size <= pool_config.max_inflight;
+	});
+	// the pulls that went first while we waited may have filled the buffer
+	if (full())
+	    return false;
+    }
+    rdma_segments.inflight += size;
+    return true;
+}
+
+void model_server_t::finish_bulk(size_t size) {
+    std::unique_lock lock(rdma_segments.buffer_lock);
+    rdma_segments.inflight -= size;
+    rdma_segments.inflight_cv.notify_all();
+}
+
+bool model_server_t::allocate_layers(const std::vector<size_t> &layer_size, std::vector<layer_t> &layers) {
+    for (int i = 0; i < layer_size.size(); i++) {
 	void *ptr;
 	try {
 	    std::unique_lock lock(rdma_segments.buffer_lock);
 	    ptr = rdma_segments.pool->allocate(layer_size[i], alignof(std::max_align_t));
 	} catch (std::bad_alloc &e) {
-	    for (int j = 0; j < i; j++)
-		rdma_segments.pool->deallocate(segments[j].first, segments[j].second);
-	    req.respond(false);
-	    return;
+	    for (auto &layer : layers)
+		release_segment(layer.segment);
+	    layers.clear();
+	    return false;
 	}
 	layers.emplace_back(layer_t(layer_size[i], ptr));
-	segments.emplace_back(layers.back().segment);
     }
+    return true;
+}
 
-    tl::bulk local = get_engine().expose(segments, tl::bulk_mode::read_write);
-    tl::endpoint ep = req.get_endpoint();
-    bulk.on(ep) >> local;
+bool model_server_t::pull_layers(const tl::request &req, const std::vector<size_t> &layer_size,
+				 const std::vector<uint8_t> &encodings, tl::bulk &bulk, std::vector<layer_t> &layers) {
+    size_t total = 0;
+    for (auto &size : layer_size)
+	total += size;
+    if (!admit_bulk(total))
+	return false;
+    if (!allocate_layers(layer_size, layers)) {
+	finish_bulk(total);
+	return false;
+    }
+    std::vector<segment_t> segments;
+    for (int i = 0; i < layers.size(); i++) {
+	// older clients do not send encodings, their layers are raw
+	if (i < encodings.size())
+	    layers[i].encoding = encodings[i];
+	segments.emplace_back(layers[i].segment);
+    }
+    if (!segments.empty()) {
+	tl::bulk local = get_engine().expose(segments, tl::bulk_mode::read_write);
+	tl::endpoint ep = req.get_endpoint();
+	bulk.on(ep) >> local;
+    }
+    finish_bulk(total);
+    return true;
+}
+
+void model_server_t::release_segment(const segment_t &segment) {
+    std::unique_lock lock(rdma_segments.buffer_lock);
+    rdma_segments.pool->deallocate(segment.first, segment.second);
+}
+
+void model_server_t::store_layers(const tl::request &req, const model_id_t &id,
+                                  const vertex_list_t &layer_id,
+                                  const std::vector<size_t> &layer_size,
+                                  const std::vector<uint8_t> &encodings, tl::bulk &bulk) {
+    std::vector<layer_t> layers;
+    if (!pull_layers(req, layer_size, encodings, bulk, layers)) {
+	req.respond(false);
+	return;
+    }
     for (int i = 0; i < layer_id.size(); i++) {
 	std::unique_lock lock(store_lock);
 	auto &lid = layer_store[layer_id[i]];
 	lock.unlock();
-	lock = std::unique_lock(lid.layer_lock);
+	std::unique_lock layer_lock(lid.layer_lock);
 	auto it = lid.owner_map.find(id);
 	if (it != lid.owner_map.end()) {
 	    auto segment = it->second.segment;
 	    it->second.segment = layers[i].segment;
-	    std::unique_lock lock(rdma_segments.buffer_lock);
-	    rdma_segments.pool->deallocate(segment.first, segment.second);
+	    it->second.encoding = layers[i].encoding;
+	    release_segment(segment);
 	} else
 	    lid.owner_map.emplace_hint(it, id, layers[i]);
     }
     req.respond(true);
 }
 
+void model_server_t::commit_model(const tl::request &req, const digraph_t &g, const composition_t &comp,
+				  const float val_acc, const ref_update_t &refs, const vertex_list_t &layer_id,
+				  const std::vector<size_t> &layer_size, const std::vector<uint8_t> &encodings,
+				  tl::bulk &layer_bulk) {
+    std::vector<layer_t> layers;
+    if (!pull_layers(req, layer_size, encodings, layer_bulk, layers)) {
+	req.respond(false);
+	return;
+    }
+    // layers, ref counters and metadata are registered under store_lock, so that get_prefix
+    // either sees the complete model or nothing at all
+    std::unique_lock lock(store_lock);
+    if (graph_info.contains(g.id)) {
+	DBG("model " << g.id << " is already registered");
+	for (auto &layer : layers)
+	    release_segment(layer.segment);
+	req.respond(false);
+	return;
+    }
+    std::unordered_map<vertex_t, std::unique_lock<tl::mutex>> layer_locks;
+    for (auto &v : layer_id)
+	layer_locks.try_emplace(v, layer_store[v].layer_lock);
+    for (auto &[owner, vertices] : refs)
+	for (auto &v : vertices) {
+	    auto it = layer_store.find(v);
+	    if (it != layer_store.end())
+		layer_locks.try_emplace(v, it->second.layer_lock);
+	    if (owner != g.id && (it == layer_store.end() || !it->second.owner_map.contains(owner))) {
+		DBG("model " << g.id << " inherits missing layer " << v << " of owner " << owner);
+		for (auto &layer : layers)
+		    release_segment(layer.segment);
+		req.respond(false);
+		return;
+	    }
+	}
+    for (int i = 0; i < layer_id.size(); i++) {
+	auto &lid = layer_store[layer_id[i]];
+	auto it = lid.owner_map.find(g.id);
+	if (it != lid.owner_map.end()) {
+	    release_segment(it->second.segment);
+	    it->second.segment = layers[i].segment;
+	    it->second.encoding = layers[i].encoding;
+	} else
+	    lid.owner_map.emplace_hint(it, g.id, layers[i]);
+    }
+    for (auto &[owner, vertices] : refs)
+	for (auto &v : vertices) {
+	    auto it = layer_store[v].owner_map.find(owner);
+	    if (it != layer_store[v].owner_map.end())
+		it->second.ref_count++;
+	}
+    register_model(g, comp, val_acc);
+    req.respond(true);
+}
+
 void model_server_t::read_layers(const tl::request &req, const vertex_list_t &layer_id,
-                                 const model_id_t &owner, tl::bulk &layer_bulk) {
+                                 const model_id_t &owner, const std::vector<size_t> &layer_size,
+                                 tl::bulk &layer_bulk) {
     std::vector<segment_t> segments;
+    read_reply_t reply;
+    bool raw = true;
+    if (layer_size.size() != layer_id.size()) {
+	req.respond(reply);
+	return;
+    }
     for (int i = 0; i < layer_id.size(); i++) {
-	std::unique_lock lock(store_lock);
-	auto &lid = layer_store[layer_id[i]];
+	std::shared_lock lock(store_lock);
+	auto l_it = layer_store.find(layer_id[i]);
+	if (l_it == layer_store.end()) {
+	    DBG("cannot find layer " << layer_id[i]);
+	    req.respond(reply);
+	    return;
+	}
+	auto &lid = l_it->second;
 	lock.unlock();
-	lock = std::unique_lock(lid.layer_lock);
+	std::unique_lock layer_lock(lid.layer_lock);
 	auto it = lid.owner_map.find(owner);
-	if (it != lid.owner_map.end())
-	    segments.emplace_back(it->second.segment);
-	else {
+	if (it == lid.owner_map.end()) {
 	    DBG("cannot find layer " << layer_id[i]);
-	    req.respond(false);
+	    req.respond(reply);
+	    return;
+	}
+	segments.emplace_back(it->second.segment);
+	reply.encodings.emplace_back(it->second.encoding);
+	reply.sizes.emplace_back(it->second.segment.second);
+	if (it->second.segment.second > layer_size[i]) {
+	    DBG("layer " << layer_id[i] << " does not fit in " << layer_size[i] << " bytes");
+	    req.respond(reply);
 	    return;
 	}
+	raw = raw && it->second.encoding == ENCODING_RAW && it->second.segment.second == layer_size[i];
     }
     tl::bulk local = get_engine().expose(segments, tl::bulk_mode::read_write);
     tl::endpoint ep = req.get_endpoint();
-    layer_bulk.on(ep) << local;
-    req.respond(true);
+    if (raw)
+	layer_bulk.on(ep) << local;
+    else {
+	// encoded layers land at the end of their destination, so that the client decodes them in place
+	size_t remote_offset = 0, local_offset = 0;
+	for (int i = 0; i < segments.size(); i++) {
+	    size_t size = segments[i].second, skip = reply.encodings[i] == ENCODING_RAW ? 0 : layer_size[i] - size;
+	    layer_bulk(remote_offset + skip, size).on(ep) << local(local_offset, size);
+	    remote_offset += layer_size[i];
+	    local_offset += size;
+	}
+    }
+    reply.ok = true;
+    req.respond(reply);
 }
 
 composition_t model_server_t::get_composition(const model_id_t &id) {
-    std::unique_lock lock(store_lock);
+    std::shared_lock lock(store_lock);
     auto it = graph_info.find(id);
     if (it == graph_info.end())
 	return composition_t();
@@ -148,44 +522,246 @@ composition_t model_server_t::get_composition(const model_id_t &id) {
 	return it->second.composition;
 }
 
+model_meta_t model_server_t::get_meta(const model_id_t &id) {
+    std::shared_lock lock(store_lock);
+    model_meta_t meta;
+    auto it = graph_info.find(id);
+    if (it == graph_info.end())
+	return meta;
+    meta.ok = true;
+    meta.graph = *it->second.index;
+    meta.composition = it->second.composition;
+    meta.val_acc = it->second.val_acc;
+    return meta;
+}
+
 prefix_t model_server_t::get_prefix(const digraph_t &child) {
-    vertex_list_t max_prefix;
-    float max_accuracy = 0;
-    uint64_t max_id = 0;
+    auto matches = get_prefixes(child, prefix_query_t());
+    if (matches.empty())
+	return std::make_pair(0, vertex_list_t());
+    return std::make_pair(matches[0].id, std::move(matches[0].prefix));
+}
+
+prefix_match_list_t model_server_t::get_prefixes(const digraph_t &child, const prefix_query_t &query) {
+    struct candidate_t {
+	const digraph_t *graph;
+	const dense_graph_t *dense;
+	size_t bound;
+	float val_acc;
+    };
+    // a scan only reads the stores, so it runs concurrently with other scans and metadata lookups
+    std::shared_lock lock(store_lock);
+    std::vector<candidate_t> candidates;
+    prefix_match_list_t result;
+    if (query.k == 0)
+	return result;
+    size_t hash = 0;
+    if (prefix_cache_size > 0) {
+	hash = structure_hash(child, query);
+	std::unique_lock cache_lock(prefix_lock);
+	auto range = prefix_cache.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	    if (same_query(it->second->child, it->second->query, child, query)) {
+		prefix_lru.splice(prefix_lru.begin(), prefix_lru, it->second);
+		return it->second->result;
+	    }
+    }
+    // in dense mode, parents and child are compared as bitsets over the catalog
+    dense_graph_t child_dense;
+    dense_scratch_t scratch;
+    if (catalog.enabled())
+	make_dense(child, catalog, false, child_dense);
     for (auto &parent : graph_store) {
-	std::deque<vertex_t> frontier{child.root};
-	std::unordered_map<vertex_t, int> visits;
-	vertex_list_t prefix;
 	auto it_graph = graph_info.find(parent.id);
-	float model_accuracy = it_graph->second.val_acc;
-	while (frontier.size() > 0) {
-	    uint64_t u = frontier.front();
-	    frontier.pop_front();
-	    prefix.push_back(u);
-	    auto c_it = child.out_edges.find(u);
-	    if (c_it == child.out_edges.end())
-		continue;
-	    auto p_it = parent.out_edges.find(u);
-	    if (p_it == parent.out_edges.end())
+	if (it_graph == graph_info.end() || query.exclude.contains(parent.id) ||
+	    it_graph->second.val_acc < query.min_accuracy)
+	    continue;
+	// besides the root, every vertex of the prefix has in-edges in both graphs
+	const dense_graph_t *dense = nullptr;
+	size_t bound;
+	if (!child_dense.empty() && !it_graph->second.dense.empty()) {
+	    dense = &it_graph->second.dense;
+	    bound = dense_bound(child_dense, *dense);
+	} else
+	    bound = sparse_bound(child, parent);
+	if (bound < query.min_prefix_len)
+	    continue;
+	candidates.emplace_back(&parent, dense, bound, it_graph->second.val_acc);
+    }
+    // most promising parents first, so we can stop as soon as the rest cannot make it in the top-k
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+	return a.bound > b.bound || (a.bound == b.bound && a.val_acc > b.val_acc);
+    });
+    for (auto &c : candidates) {
+	if (result.size() == query.k) {
+	    auto &last = result.back();
+	    if (c.bound < last.prefix.size() || (c.bound == last.prefix.size() && c.val_acc <= last.val_acc))
+		break;
+	}
+	prefix_match_t match{c.graph->id,
+			     c.dense ? dense_lcp(child_dense, *c.dense, catalog, scratch) : get_lcp(child, *c.graph),
+			     c.val_acc};
+	if (match.prefix.size() >= query.min_prefix_len)
+	    insert_match(result, std::move(match), query.k);
+    }
+    if (prefix_cache_size > 0) {
+	std::unique_lock cache_lock(prefix_lock);
+	if (prefix_lru.size() == prefix_cache_size)
+	    prefix_cache_erase(std::prev(prefix_lru.end()));
+	prefix_lru.emplace_front(hash, child, query, result);
+	prefix_cache.emplace(hash, prefix_lru.begin());
+    }
+    return result;
+}
+
+// reads the model list of an exported file and counts the references that its models, except the
+// skipped ones, hold on the layers of provider index; fd stays open on success
+static bool read_import_plan(const std::string &path, const uint32_t &providers, const uint32_t &index,
+			     const std::unordered_set<model_id_t> &skip, int &fd, model_file_meta_t &meta,
+			     std::map<std::pair<vertex_t, model_id_t>, size_t> &refs) {
+    model_file_header_t header;
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || !meta.read(fd, header)) {
+	DBG("cannot import models from " << path);
+	if (fd >= 0)
+	    close(fd);
+	return false;
+    }
+    for (auto &m : meta.models)
+	if (!skip.contains(m.graph.id))
+	    for (auto &[v, e] : m.composition)
+		if (e.first % providers == index)
+		    refs[{v, e.first}]++;
+    return true;
+}
+
+std::pair<bool, model_id_list_t> model_server_t::import_models(const std::string &path, const uint32_t &providers,
+							       const uint32_t &index, const model_id_list_t &existing) {
+    // the file is shared by all providers, each one takes the models and layers it would host
+    std::pair<bool, model_id_list_t> result(false, model_id_list_t());
+    // models that already exist hold their references, only the imported ones add to the ref counters
+    std::unordered_set<model_id_t> skip(existing.begin(), existing.end());
+    std::map<std::pair<vertex_t, model_id_t>, size_t> refs;
+    model_file_meta_t meta;
+    int fd;
+    if (!read_import_plan(path, providers, index, skip, fd, meta, refs))
+	return result;
+    // owned: layers hosted here that the imported models reference, selected: those we do not hold yet
+    std::vector<model_file_layer_t> owned, selected;
+    std::vector<size_t> layer_size;
+    size_t total = 0;
+    for (auto &l : meta.layers) {
+	if (!refs.contains({l.vertex, l.owner}))
+	    continue;
+	owned.emplace_back(l);
+	std::shared_lock lock(store_lock);
+	auto it = layer_store.find(l.vertex);
+	if (it != layer_store.end()) {
+	    std::unique_lock layer_lock(it->second.layer_lock);
+	    if (it->second.owner_map.contains(l.owner))
 		continue;
-	    for (auto const &v : c_it->second) {
-		if (p_it->second.count(v)) {
-		    visits[v]++;
-		    if (visits[v] == std::max(child.in_degree.at(v), parent.in_degree.at(v)))
-			frontier.push_back(v);
-		}
-	    }
 	}
-	auto prefix_len = prefix.size();
-	auto max_prefix_len = max_prefix.size();
-	if ((prefix_len > max_prefix_len) ||
-            ((prefix_len == max_prefix_len) && (model_accuracy > max_accuracy))) {
-	    std::swap(prefix, max_prefix);
-	    max_accuracy = model_accuracy;
-	    max_id = parent.id;
+	selected.emplace_back(l);
+	layer_size.emplace_back(l.size);
+	total += l.size;
+    }
+    std::vector<layer_t> layers;
+    if (!admit_bulk(total)) {
+	close(fd);
+	return result;
+    }
+    if (!allocate_layers(layer_size, layers)) {
+	finish_bulk(total);
+	close(fd);
+	return result;
+    }
+    auto discard = [&] {
+	for (auto &layer : layers)
+	    release_segment(layer.segment);
+	finish_bulk(total);
+    };
+    // the layers are sorted by offset, so reading them one after the other streams through the file
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (int i = 0; i < selected.size(); i++)
+	if (!pread_all(fd, (char *)layers[i].segment.first, selected[i].size, selected[i].offset)) {
+	    DBG("cannot read layer " << selected[i].vertex << " of owner " << selected[i].owner << " from " << path);
+	    discard();
+	    close(fd);
+	    return result;
+	}
+    close(fd);
+    // everything is checked before anything changes, so that a failed import leaves no trace here
+    std::unique_lock lock(store_lock);
+    for (auto &m : meta.models)
+	if (m.graph.id % providers == index && !skip.contains(m.graph.id) && graph_info.contains(m.graph.id)) {
+	    DBG("model " << m.graph.id << " was registered during the import");
+	    discard();
+	    return result;
+	}
+    std::unordered_map<vertex_t, std::unique_lock<tl::mutex>> layer_locks;
+    // selected is a subsequence of owned, both are in file order
+    for (size_t i = 0, j = 0; i < owned.size(); i++) {
+	auto &l = owned[i];
+	bool loaded = j < selected.size() && selected[j].offset == l.offset;
+	if (loaded) {
+	    j++;
+	    layer_locks.try_emplace(l.vertex, layer_store[l.vertex].layer_lock);
+	    continue;
+	}
+	auto it = layer_store.find(l.vertex);
+	if (it != layer_store.end())
+	    layer_locks.try_emplace(l.vertex, it->second.layer_lock);
+	if (it == layer_store.end() || !it->second.owner_map.contains(l.owner)) {
+	    DBG("layer " << l.vertex << " of owner " << l.owner << " was released during the import");
+	    discard();
+	    return result;
+	}
+    }
+    for (size_t i = 0, j = 0; i < owned.size(); i++) {
+	auto &l = owned[i];
+	bool loaded = j < selected.size() && selected[j].offset == l.offset;
+	auto &lid = layer_store[l.vertex];
+	size_t count = refs[{l.vertex, l.owner}];
+	auto it = lid.owner_map.find(l.owner);
+	if (it != lid.owner_map.end()) {
+	    // layers are immutable, the copy we already hold serves the imported models too
+	    it->second.ref_count += count;
+	    if (loaded)
+		release_segment(layers[j].segment);
+	} else {
+	    layers[j].ref_count = count;
+	    lid.owner_map.emplace_hint(it, l.owner, layers[j]);
 	}
+	if (loaded)
+	    j++;
     }
-    return std::make_pair(max_id, max_prefix);
+    for (auto &m : meta.models)
+	if (m.graph.id % providers == index && !skip.contains(m.graph.id) &&
+	    register_model(m.graph, m.composition, m.val_acc))
+	    result.second.emplace_back(m.graph.id);
+    finish_bulk(total);
+    result.first = true;
+    return result;
+}
+
+bool model_server_t::abort_import(const std::string &path, const uint32_t &providers, const uint32_t &index,
+				  const model_id_list_t &existing) {
+    // undoes a successful import_models when another provider failed its share, from the same plan
+    std::unordered_set<model_id_t> skip(existing.begin(), existing.end());
+    std::map<std::pair<vertex_t, model_id_t>, size_t> refs;
+    model_file_meta_t meta;
+    int fd;
+    if (!read_import_plan(path, providers, index, skip, fd, meta, refs))
+	return false;
+    close(fd);
+    std::unique_lock lock(store_lock);
+    for (auto &m : meta.models)
+	if (m.graph.id % providers == index && !skip.contains(m.graph.id))
+	    retire_model(m.graph.id);
+    for (auto &[key, count] : refs)
+	for (size_t i = 0; i < count; i++)
+	    release_layer(key.first, key.second);
+    return true;
 }
 
 int model_server_t::shutdown() {
@@ -194,16 +770,13 @@ int model_server_t::shutdown() {
 }
 
 void model_server_t::rdma_buffers_init(tl::engine &e) {
-    rdma_segments.buffer = new char[pinned_buffer_size];
+    rdma_segments.region = std::make_unique<pinned_buffer_t>(pinned_buffer_size, buffer_options);
+    rdma_segments.buffer = rdma_segments.region->data();
     std::vector<std::pair<void *, std::size_t>> segments(1);
     segments[0].first = (void *)(&rdma_segments.buffer[0]);
     segments[0].second = pinned_buffer_size;
     e.expose(segments, tl::bulk_mode::read_write);
 
-    rdma_segments.buffer_resource =
-	std::make_unique<std::pmr::monotonic_buffer_resource>(rdma_segments.buffer,
-							      pinned_buffer_size, std::pmr::null_memory_resource());
-    rdma_segments.pool =
-	std::make_unique<std::pmr::unsynchronized_pool_resource>(rdma_segments.buffer_resource.get());
+    rdma_segments.pool = std::make_unique<region_resource_t>(rdma_segments.buffer, pinned_buffer_size);
 }
 } // namespace dstates::ai
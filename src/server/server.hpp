@@ -2,7 +2,12 @@
 #define __DSTATES_AI_SERVER_HPP
 
 #include "dstates/ai/types.hpp"
+#include "dense_graph.hpp"
+#include "pinned_memory.hpp"
+#include "region_resource.hpp"
 
+#include <list>
+#include <shared_mutex>
 #include <memory_resource>
 #include <thallium.hpp>
 
@@ -11,25 +16,62 @@ using namespace std::chrono;
 
 namespace dstates::ai {
 
+/**
+ * execution streams of each class of requests and admission control of bulk transfers
+ */
+struct pool_config_t {
+    /// latency sensitive metadata requests, these have priority on all streams
+    uint32_t meta_threads = 1;
+    /// store_layers, read_layers and commit_model, 0 to serve them on the metadata streams
+    uint32_t bulk_threads = 1;
+    /// prefix queries, 0 to serve them on the metadata streams
+    uint32_t scan_threads = 1;
+    /// fraction of the pinned buffer above which new layers are rejected
+    double high_watermark = 0.95;
+    /// bytes of layers being pulled at the same time before new pulls wait, 0 for no limit
+    size_t max_inflight = 0;
+};
+
+/**
+ * tl::rwlock with the interface of std::shared_mutex, so that it works with std::unique_lock and std::shared_lock
+ */
+class shared_rwlock_t {
+    tl::rwlock rwlock;
+
+public:
+    void lock() { rwlock.wrlock(); }
+    bool try_lock() { return rwlock.try_wrlock(); }
+    void unlock() { rwlock.unlock(); }
+    void lock_shared() { rwlock.rdlock(); }
+    bool try_lock_shared() { return rwlock.try_rdlock(); }
+    void unlock_shared() { rwlock.unlock(); }
+};
+
 class model_server_t : public tl::provider<model_server_t> {
     struct model_info_t {
-	std::vector<digraph_t>::iterator index;
+	std::list<digraph_t>::iterator index;
 	composition_t composition;
 	float val_acc;
-	model_info_t(const std::vector<digraph_t>::iterator &idx, const composition_t &comp,
+	dense_graph_t dense;
+	model_info_t(const std::list<digraph_t>::iterator &idx, const composition_t &comp,
                      const float &acc)
         : index(idx), composition(comp), val_acc(acc) {}
     };
 
     struct rdma_buffer_t {
 	tl::mutex buffer_lock;
+	tl::condition_variable inflight_cv;
 	char *buffer;
-	std::unique_ptr<std::pmr::memory_resource> buffer_resource, pool;
+	std::unique_ptr<pinned_buffer_t> region;
+	/// layer segments carved out of region, freed segments are reused
+	std::unique_ptr<region_resource_t> pool;
+	size_t inflight = 0;
     };
 
     struct layer_t {
 	segment_t segment;
 	size_t ref_count;
+	uint8_t encoding = ENCODING_RAW;
 	layer_t(size_t size, void *ptr) : segment{ptr, size}, ref_count(0) {}
     };
 
@@ -38,30 +80,86 @@ class model_server_t : public tl::provider<model_server_t> {
 	std::unordered_map<model_id_t, layer_t> owner_map;
     };
 
-    tl::managed<tl::pool> request_pool;
+    /**
+     * lineage edges derived from the compositions, a retired model stays while it has descendants
+     */
+    struct lineage_t {
+	std::unordered_set<model_id_t> parents, children;
+    };
+
+    /**
+     * memoized get_prefixes result, child is kept to compare it against newly stored models
+     */
+    struct prefix_entry_t {
+	size_t hash;
+	digraph_t child;
+	prefix_query_t query;
+	prefix_match_list_t result;
+    };
+
+    tl::managed<tl::pool> meta_pool, bulk_pool, scan_pool;
     std::vector<tl::managed<tl::xstream>> ess;
-    std::vector<digraph_t> graph_store;
+    std::list<digraph_t> graph_store;
     std::unordered_map<uint64_t, model_info_t> graph_info;
     std::unordered_map<vertex_t, layer_info_t> layer_store;
     rdma_buffer_t rdma_segments;
-    tl::mutex store_lock;
+    /// queries and lookups share it, anything that changes the stores or the lineage takes it exclusively
+    shared_rwlock_t store_lock;
     std::vector<tl::remote_procedure> procedures;
     std::string policy;
     size_t pinned_buffer_size;
+    pool_config_t pool_config;
+    buffer_options_t buffer_options;
+    dense_catalog_t catalog;
+    std::unordered_map<model_id_t, lineage_t> lineage;
+    /// guards the prefix cache under a shared store_lock, holders of the exclusive store_lock do not need it
+    tl::mutex prefix_lock;
+    std::list<prefix_entry_t> prefix_lru;
+    std::unordered_multimap<size_t, std::list<prefix_entry_t>::iterator> prefix_cache;
+    size_t prefix_cache_size;
+
+    bool admit_bulk(size_t size);
+    void finish_bulk(size_t size);
+    bool allocate_layers(const std::vector<size_t> &layer_size, std::vector<layer_t> &layers);
+    bool pull_layers(const tl::request &req, const std::vector<size_t> &layer_size,
+		     const std::vector<uint8_t> &encodings, tl::bulk &bulk, std::vector<layer_t> &layers);
+    void release_segment(const segment_t &segment);
+    bool register_model(const digraph_t &g, const composition_t &comp, const float val_acc);
+    void retire_model(const model_id_t &id);
+    void prefix_cache_erase(std::list<prefix_entry_t>::iterator entry);
+    void lineage_prune(const model_id_t &id);
+    model_id_list_t lineage_closure(const model_id_list_t &ids, bool ancestors);
+    bool release_layer(const vertex_t &v, const model_id_t &owner);
 
 public:
-    model_server_t(tl::engine &e, uint16_t provider_id = 0, uint32_t num_procs = 1,
+    model_server_t(tl::engine &e, uint16_t provider_id = 0, const pool_config_t &pools = pool_config_t(),
 		   size_t buffer_size = DEFAULT_BUFFER_SIZE,
-                   std::string const &server_policy = std::string("map"));
+                   std::string const &server_policy = std::string("map"), size_t dense_ids = 0,
+		   size_t prefix_cache_entries = 0, const buffer_options_t &buffer_opts = buffer_options_t());
     ~model_server_t();
     bool store_meta(const digraph_t &g, const composition_t &comp, const float val_acc);
     prefix_t get_prefix(const digraph_t &child);
+    prefix_match_list_t get_prefixes(const digraph_t &child, const prefix_query_t &query);
     composition_t get_composition(const model_id_t &id);
+    model_meta_t get_meta(const model_id_t &id);
     void store_layers(const tl::request &req, const model_id_t &id, const vertex_list_t &layer_id,
-                      const std::vector<size_t> &layer_size, tl::bulk &layer_bulk);
+                      const std::vector<size_t> &layer_size, const std::vector<uint8_t> &encodings,
+                      tl::bulk &layer_bulk);
     void read_layers(const tl::request &req, const vertex_list_t &layer_id, const model_id_t &owner,
-                     tl::bulk &layer_bulk);
+                     const std::vector<size_t> &layer_size, tl::bulk &layer_bulk);
     bool update_ref_counter(const model_id_t &owner, const vertex_list_t &layer_id, int value);
+    void commit_model(const tl::request &req, const digraph_t &g, const composition_t &comp,
+		      const float val_acc, const ref_update_t &refs, const vertex_list_t &layer_id,
+		      const std::vector<size_t> &layer_size, const std::vector<uint8_t> &encodings,
+		      tl::bulk &layer_bulk);
+    model_id_list_t get_ancestors(const model_id_list_t &ids);
+    model_id_list_t get_descendants(const model_id_list_t &ids);
+    std::pair<model_id_list_t, ref_update_t> retire_subtree(const model_id_list_t &roots,
+							    const ref_update_t &releases);
+    std::pair<bool, model_id_list_t> import_models(const std::string &path, const uint32_t &providers,
+						   const uint32_t &index, const model_id_list_t &existing);
+    bool abort_import(const std::string &path, const uint32_t &providers, const uint32_t &index,
+		      const model_id_list_t &existing);
     int shutdown();
     void rdma_buffers_init(tl::engine &e);
 };
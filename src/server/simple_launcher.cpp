@@ -9,38 +9,79 @@ static struct option long_ops[] = {
     {"connection", required_argument, 0, 'c'},
     {"provider", required_argument, 0, 'p'},
     {"threads", required_argument, 0, 't'},
+    {"bulk-threads", required_argument, 0, 'B'},
+    {"scan-threads", required_argument, 0, 'S'},
+    {"max-inflight", required_argument, 0, 'I'},
+    {"high-watermark", required_argument, 0, 'W'},
     {"buffer-size", required_argument, 0, 'b'},
+    {"dense-ids", required_argument, 0, 'd'},
+    {"prefix-cache", required_argument, 0, 'm'},
+    {"page-size", required_argument, 0, 'P'},
+    {"numa-node", required_argument, 0, 'N'},
+    {"buffer-file", required_argument, 0, 'F'},
+    {"prefault-threads", required_argument, 0, 'T'},
     {0, 0, 0, 0}
 };
 
 void exit_with_usage() {
     std::cerr << "Usage: launcher --connection <conn_string> [--provider <id> (default 0)] [--threads <thread_no> (default 1)] [--buffer_size <buff_size> (default 1 GiB)]" << std::endl
-    << "Note: shortcuts (-c, -p, -t, -b) are also allowed" << std::endl
+    << "                [--bulk-threads <thread_no> (default 1)] [--scan-threads <thread_no> (default 1)]" << std::endl
+    << "                [--max-inflight <bytes> (default 0, i.e. unlimited)] [--high-watermark <fraction> (default 0.95)]" << std::endl
+    << "                [--dense-ids <catalog_size> (default 0, i.e. sparse prefix matching)]" << std::endl
+    << "                [--prefix-cache <entries> (default 0, i.e. no memoization of prefix queries)]" << std::endl
+    << "                [--page-size <bytes> (default 0, i.e. regular pages, 2 MiB and 1 GiB select huge pages)]" << std::endl
+    << "                [--numa-node <node> (default -1, i.e. no binding)] [--buffer-file <path> (default anonymous memory)]" << std::endl
+    << "                [--prefault-threads <thread_no> (default 0, i.e. lazy population)]" << std::endl
+    << "Note: shortcuts (-c, -p, -t, -B, -S, -I, -W, -b, -d, -m, -P, -N, -F, -T) are also allowed" << std::endl
+    << "Note: --threads sets the metadata threads, with 0 bulk or scan threads those requests run on the metadata threads" << std::endl
     << "See the Thallium documentation for more details." << std::endl;
     exit(-1);
 }
 
 int main(int argc, char **argv) {
     std::string thallium_conn;
-    unsigned int provider_id = 0, thread_no = 1;
-    size_t buff_size = dstates::ai::DEFAULT_BUFFER_SIZE;
+    unsigned int provider_id = 0;
+    dstates::ai::pool_config_t pools;
+    dstates::ai::buffer_options_t buffer_opts;
+    size_t buff_size = dstates::ai::DEFAULT_BUFFER_SIZE, dense_ids = 0, prefix_cache = 0;
 
     int ret, args_set = 0;
-    while ((ret = getopt_long(argc, argv, "c:p:t:", long_ops, NULL)) != -1)
+    while ((ret = getopt_long(argc, argv, "c:p:t:B:S:I:W:b:d:m:P:N:F:T:", long_ops, NULL)) != -1)
         if (ret == 'c')
 	    thallium_conn = optarg;
 	else if (ret == 'p' && sscanf(optarg, "%u", &provider_id) != 1)
 	    exit_with_usage();
-	else if (ret == 't' && sscanf(optarg, "%u", &thread_no) != 1)
+	else if (ret == 't' && sscanf(optarg, "%u", &pools.meta_threads) != 1)
+	    exit_with_usage();
+	else if (ret == 'B' && sscanf(optarg, "%u", &pools.bulk_threads) != 1)
+	    exit_with_usage();
+	else if (ret == 'S' && sscanf(optarg, "%u", &pools.scan_threads) != 1)
+	    exit_with_usage();
+	else if (ret == 'I' && sscanf(optarg, "%lu", &pools.max_inflight) != 1)
+	    exit_with_usage();
+	else if (ret == 'W' && sscanf(optarg, "%lf", &pools.high_watermark) != 1)
 	    exit_with_usage();
 	else if (ret == 'b' && sscanf(optarg, "%lu", &buff_size) != 1)
 	    exit_with_usage();
+	else if (ret == 'd' && sscanf(optarg, "%lu", &dense_ids) != 1)
+	    exit_with_usage();
+	else if (ret == 'm' && sscanf(optarg, "%lu", &prefix_cache) != 1)
+	    exit_with_usage();
+	else if (ret == 'P' && sscanf(optarg, "%lu", &buffer_opts.page_size) != 1)
+	    exit_with_usage();
+	else if (ret == 'N' && sscanf(optarg, "%d", &buffer_opts.numa_node) != 1)
+	    exit_with_usage();
+	else if (ret == 'F')
+	    buffer_opts.file = optarg;
+	else if (ret == 'T' && sscanf(optarg, "%u", &buffer_opts.prefault_threads) != 1)
+	    exit_with_usage();
 
     if (thallium_conn.empty())
 	exit_with_usage();
 
     tl::engine model_server_engine(thallium_conn, THALLIUM_SERVER_MODE);
-    dstates::ai::model_server_t model_server(model_server_engine, provider_id, thread_no, buff_size);
+    dstates::ai::model_server_t model_server(model_server_engine, provider_id, pools, buff_size, "map", dense_ids,
+					     prefix_cache, buffer_opts);
     INFO("Model server listening at: " << model_server_engine.self());
 
     return 0;
@@ -1,4 +1,6 @@
 import argparse
+import os
+import tempfile
 import torch
 import dstates.ai
 
@@ -10,7 +12,8 @@ if __name__ == "__main__":
 
     # initialization
     torch.manual_seed(1729)
-    backend = dstates.ai.evostore(args.connection.split('://')[0], [args.connection], 1 << 30)
+    backend = dstates.ai.evostore(args.connection.split('://')[0], [args.connection], 1 << 30,
+                                  cache_size=1 << 20, prefetch=True)
 
     # save layers
     t1 = torch.rand(4, 5)
@@ -33,6 +36,7 @@ if __name__ == "__main__":
     (id, lids) = backend.get_prefix(edges)
     print("Model with longest prefix = %u, layer ids = %s" % (id, lids))
     assert len(lids) == 2
+    assert backend.get_prefix(edges) == (id, lids)
 
     # load layers
     t5 = torch.zeros(4, 5)
@@ -45,4 +49,115 @@ if __name__ == "__main__":
     # compare layers
     assert torch.equal(t1, t5) and torch.equal(t4, t6) and torch.equal(t3, t7)
 
+    # load again, now served from the client cache
+    t8 = torch.zeros(4, 5)
+    t9 = torch.zeros(2, 64)
+    assert backend.load_layers([t8, t9], 2, [0, 3], [1, 2]) == True
+    assert torch.equal(t1, t8) and torch.equal(t4, t9)
+
+    # commit layers, metadata and ref counters in one request
+    t10 = torch.rand(1, 20)
+    assert backend.commit_model([t10], 3, [0, 3, 3, 4], [0, 3, 4], [1, 2, 3], [80, 512, 80], 0.5) == True
+    t11 = torch.zeros(1, 20)
+    assert backend.load_layers([t11], 3, [4], [3]) == True
+    assert torch.equal(t10, t11)
+    # committing the same id again is rejected, and does not leave a second copy of the model behind
+    assert backend.commit_model([t10], 3, [0, 3, 3, 4], [0, 3, 4], [1, 2, 3], [80, 512, 80], 0.5) == False
+    assert backend.store_meta(3, [0, 3, 3, 4], [0, 3, 4], [1, 2, 3], [80, 512, 80], 0.5) == False
+
+    # top-k prefix queries with filters
+    edges = [0, 3, 3, 4]
+    assert sorted(m.id for m in backend.get_prefixes(edges, 4)) == [1, 2, 3]
+    matches = backend.get_prefixes(edges, 2)
+    assert len(matches) == 2 and matches[0].id == 3 and len(matches[0].prefix) == 3
+    matches = backend.get_prefixes(edges, 3, exclude=[3])
+    assert len(matches) == 2 and matches[0].id == 2 and len(matches[0].prefix) == 2
+    matches = backend.get_prefixes(edges, 3, min_accuracy=0.1)
+    assert len(matches) == 1 and matches[0].id == 3
+    assert len(backend.get_prefixes(edges, 3, min_prefix_len=4)) == 0
+
+    # memoized results follow newly committed models
+    (id, lids) = backend.get_prefix([0, 3, 3, 1])
+    assert id == 3 and len(lids) == 2
+
+    # lineage queries and subtree retirement
+    assert set(backend.get_ancestors(3)) == {1, 2}
+    assert set(backend.get_descendants(1)) == {2, 3}
+    assert list(backend.retire_subtree(3)) == [3]
+    assert len(backend.get_descendants(2)) == 0
+    assert backend.load_layers([t11], 3, [4], [3]) == False
+
+    # reduced precision storage, decoded back to fp32 on load
+    t12 = torch.randn(8, 64)
+    t13 = torch.randn(8, 64)
+    encodings = [dstates.ai.encoding_t.BF16, dstates.ai.encoding_t.INT8]
+    assert backend.save_layers([t12, t13], 4, [5, 6], encodings=encodings) == True
+    t14 = torch.zeros(8, 64)
+    t15 = torch.zeros(8, 64)
+    assert backend.load_layers([t14, t15], 4, [5, 6], [4, 4]) == True
+    assert torch.allclose(t12, t14, rtol=1e-2, atol=0)
+    assert torch.allclose(t13, t15, rtol=0, atol=t13.abs().max().item() / 127)
+    t21 = torch.randn(8, 64)
+    assert backend.save_layers([t21], 4, [7], encodings=[dstates.ai.encoding_t.FP16]) == True
+    t22 = torch.zeros(8, 64)
+    assert backend.load_layers([t22], 4, [7], [4]) == True
+    assert torch.allclose(t21, t22, rtol=1e-3, atol=1e-4)
+    # encoded layers only decode into fp32 tensors of their own size, cached copies included
+    assert backend.load_layers([torch.zeros(16, 64)], 4, [6], [4]) == False
+    assert backend.load_layers([torch.zeros(8, 64, dtype=torch.bfloat16)], 4, [5], [4]) == False
+    assert backend.load_layers([torch.zeros(16, 64, dtype=torch.bfloat16)], 4, [5], [4]) == False
+
+    # export to a mapped file and import it back
+    t16 = torch.rand(4, 5)
+    t17 = torch.rand(2, 64)
+    assert backend.commit_model([t16, t17], 5, [0, 1], [0, 1], [5, 5], [80, 512], 0.3) == True
+    path = os.path.join(tempfile.mkdtemp(), "models.evo")
+    assert backend.export_models([5], path) == True
+    model_file = dstates.ai.model_file(path)
+    assert list(model_file.models()) == [5] and list(model_file.get_edges(5)) == [0, 1]
+    view = torch.from_numpy(model_file.get_layer(0, 5)).view(torch.float32).reshape(4, 5)
+    assert torch.equal(t16, view)
+    assert list(backend.retire_subtree(5)) == [5]
+    assert list(backend.import_models(path)) == [5]
+    t18 = torch.zeros(4, 5)
+    t19 = torch.zeros(2, 64)
+    assert backend.load_layers([t18, t19], 5, [0, 1], [5, 5]) == True
+    assert torch.equal(t16, t18) and torch.equal(t17, t19)
+    # models that exist already are not imported again, a file that cannot be read is a failure
+    assert list(backend.import_models(path)) == []
+    assert backend.import_models(path + ".missing") is None
+    # an imported model adds its references to the layers the server still holds
+    t20 = torch.rand(1, 20)
+    assert backend.commit_model([t20], 8, [0, 9], [0, 9], [5, 8], [80, 80], 0.4) == True
+    assert backend.export_models([8], path) == True
+    assert list(backend.retire_subtree(8)) == [8]
+    assert list(backend.import_models(path)) == [8]
+    assert list(backend.retire_subtree(8)) == [8]
+    assert backend.load_layers([t18], 5, [0], [5]) == True
+    assert torch.equal(t16, t18)
+
+    # evicted cache entries give their memory back, so the cache keeps working past the staging buffer size
+    small = dstates.ai.evostore(args.connection.split('://')[0], [args.connection], 1 << 20,
+                                cache_size=1 << 18)
+    layers = [torch.rand(128, 256) for _ in range(4)]
+    assert small.commit_model(layers, 6, [10, 11, 11, 12, 12, 13], [10, 11, 12, 13], [6, 6, 6, 6],
+                              [1 << 17] * 4, 0.1) == True
+    for i in range(32):
+        loaded = [torch.zeros(128, 256) for _ in range(4)]
+        assert small.load_layers(loaded, 6, [10, 11, 12, 13], [6, 6, 6, 6]) == True
+        assert all(torch.equal(a, b) for a, b in zip(layers, loaded))
+    # each round hits two layers and evicts them to cache the other two, the last one leaves 10 and 11
+    assert list(backend.retire_subtree(6)) == [6]
+    loaded = [torch.zeros(128, 256) for _ in range(2)]
+    assert small.load_layers(loaded, 6, [10, 11], [6, 6]) == True
+    assert torch.equal(layers[0], loaded[0]) and torch.equal(layers[1], loaded[1])
+    assert small.load_layers([torch.zeros(128, 256)], 6, [12], [6]) == False
+
+    # encoding does not take staging memory for good, saving far more than the buffer size keeps working
+    for i in range(32):
+        assert small.save_layers([layers[0]], 7, [14], encodings=[dstates.ai.encoding_t.BF16]) == True
+    loaded = torch.zeros(128, 256)
+    assert small.load_layers([loaded], 7, [14], [7]) == True
+    assert torch.allclose(layers[0], loaded, rtol=1e-2, atol=0)
+
     print("Success")